@@ -28,6 +28,7 @@ if [ $? -eq 0 ]; then
     echo "  - user_main"
     echo "  - server_main"
     echo "  - device_main"
+    echo "  - prf_batch"
     echo ""
     echo "To run the system:"
     echo "  1. Start server: ./server_main"
@@ -0,0 +1,153 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include "common/runtime.hpp"
+
+// 服务器请求的准入控制与优先级调度。请求按kind分为四个优先级类别，每类有自己的排队上限和并发上限：
+//
+//   INTERACTIVE  verification_request / server_verification / key_agreement，用户在线等待，优先级最高
+//   WRITE        register_server / store_cipher / migrate_user / post_update_verification
+//   BULK         batch_verification_request / revoke_devices，单个请求耗时长
+//   BACKGROUND   status及无法识别的请求
+//
+// 类别队列已满的请求在IO线程上立即被拒绝（由调用方回复busy），不进入队列也不占用工作线程。
+// 工作线程每次取优先级最高、且未达到并发上限的类别的队首请求，因此过载时排队和拒绝
+// 首先落在批量撤销和状态轮询上，交互式验证的延迟不受影响
+namespace admission {
+
+enum class Priority { INTERACTIVE = 0, WRITE, BULK, BACKGROUND };
+constexpr size_t PRIORITY_COUNT = 4;
+
+inline const char* to_string(Priority p){
+    switch(p){
+        case Priority::INTERACTIVE: return "interactive";
+        case Priority::WRITE: return "write";
+        case Priority::BULK: return "bulk";
+        case Priority::BACKGROUND: return "background";
+    }
+    return "unknown";
+}
+
+// 由配置中的类别名得到类别，未知名称返回false
+inline bool parse_priority(const std::string &name, Priority &out){
+    for(size_t i = 0; i < PRIORITY_COUNT; i++){
+        if(name == to_string((Priority)i)){ out = (Priority)i; return true; }
+    }
+    return false;
+}
+
+inline Priority classify(const std::string &kind){
+    if(kind == "verification_request" || kind == "server_verification" || kind == "key_agreement") return Priority::INTERACTIVE;
+    if(kind == "register_server" || kind == "store_cipher" || kind == "migrate_user" || kind == "post_update_verification") return Priority::WRITE;
+    if(kind == "batch_verification_request" || kind == "revoke_devices") return Priority::BULK;
+    return Priority::BACKGROUND;
+}
+
+struct ClassLimits {
+    int max_running{0};  // 同时在工作线程上执行的上限，0表示只受线程数限制
+    int max_queued{0};   // 排队等待的上限，0表示不限
+};
+
+using Limits = std::array<ClassLimits, PRIORITY_COUNT>;
+
+// 缺省：交互式与写请求只受线程数限制；批量和后台请求各最多占用一个工作线程
+inline Limits default_limits(){
+    Limits l;
+    l[(size_t)Priority::INTERACTIVE] = {0, 1024};
+    l[(size_t)Priority::WRITE] = {0, 256};
+    l[(size_t)Priority::BULK] = {1, 64};
+    l[(size_t)Priority::BACKGROUND] = {1, 64};
+    return l;
+}
+
+// 挂在WorkerPool上的优先级调度器。每个入队的请求向线程池提交一个"令牌"，令牌执行时才挑选
+// 当前最该执行的请求，因此高优先级请求可以越过先到的低优先级请求。挑不出可执行的请求时
+// （只剩达到并发上限的类别）令牌被记下，等某个请求完成时再重新提交
+class Scheduler {
+public:
+    Scheduler(crypto_runtime::WorkerPool &pool, const Limits &limits) : pool_(pool) {
+        for(size_t i = 0; i < PRIORITY_COUNT; i++) classes_[i].limits = limits[i];
+    }
+
+    Scheduler(const Scheduler&) = delete;
+    Scheduler& operator=(const Scheduler&) = delete;
+
+    // 请求入队；所属类别的队列已满时返回false，task不会被执行
+    bool try_submit(Priority p, std::function<void()> task){
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            Class &c = classes_[(size_t)p];
+            if(c.limits.max_queued > 0 && c.queue.size() >= (size_t)c.limits.max_queued){
+                c.rejected++;
+                return false;
+            }
+            c.queue.push_back(std::move(task));
+        }
+        pool_.submit([this]{ run_one(); });
+        return true;
+    }
+
+    uint64_t rejected(Priority p) const {
+        std::lock_guard<std::mutex> lk(mu_);
+        return classes_[(size_t)p].rejected;
+    }
+
+    const ClassLimits& limits(Priority p) const { return classes_[(size_t)p].limits; }
+
+private:
+    struct Class {
+        ClassLimits limits;
+        std::deque<std::function<void()>> queue;
+        int running{0};
+        uint64_t rejected{0};
+    };
+
+    void run_one(){
+        std::function<void()> task;
+        size_t picked = PRIORITY_COUNT;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            for(size_t i = 0; i < PRIORITY_COUNT; i++){
+                Class &c = classes_[i];
+                if(c.queue.empty()) continue;
+                if(c.limits.max_running > 0 && c.running >= c.limits.max_running) continue;
+                picked = i;
+                break;
+            }
+            if(picked == PRIORITY_COUNT){
+                deferred_++;
+                return;
+            }
+            Class &c = classes_[picked];
+            task = std::move(c.queue.front());
+            c.queue.pop_front();
+            c.running++;
+        }
+        try {
+            task();
+        } catch(...) {
+            // 请求处理函数自行回复错误，这里只保证计数正确
+        }
+        bool resubmit = false;
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            classes_[picked].running--;
+            if(deferred_ > 0){
+                deferred_--;
+                resubmit = true;
+            }
+        }
+        if(resubmit) pool_.submit([this]{ run_one(); });
+    }
+
+    crypto_runtime::WorkerPool &pool_;
+    mutable std::mutex mu_;
+    std::array<Class, PRIORITY_COUNT> classes_;
+    size_t deferred_{0};
+};
+
+} // namespace admission
@@ -0,0 +1,71 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// 一致性哈希环：按用户ID把请求划分给若干节点（同机的分片进程或集群中的服务器）。
+// 每个节点在环上放置若干虚拟节点，增删节点时只有相邻区间的用户改变归属。
+// 哈希函数固定为FNV-1a加混合，保证不同进程、不同构建算出的归属一致
+namespace cluster {
+
+inline uint64_t hash64(std::string_view s){
+    uint64_t h = 1469598103934665603ULL;
+    for(unsigned char c : s){
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    // splitmix64的收尾混合，改善短键的分布
+    h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27; h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+class HashRing {
+public:
+    static constexpr int DEFAULT_VNODES = 64;
+
+    // tag区分不同用途的环（集群节点、同机分片），使两级划分互不相关
+    explicit HashRing(int vnodes = DEFAULT_VNODES, std::string tag = "node")
+        : vnodes_(vnodes > 0 ? vnodes : 1), tag_(std::move(tag)) {}
+
+    void add(int node){
+        if(!nodes_.insert(node).second) return;
+        for(int v = 0; v < vnodes_; v++) ring_[point(node, v)] = node;
+    }
+
+    void remove(int node){
+        if(!nodes_.erase(node)) return;
+        for(int v = 0; v < vnodes_; v++){
+            auto it = ring_.find(point(node, v));
+            if(it != ring_.end() && it->second == node) ring_.erase(it);
+        }
+    }
+
+    // 负责key的节点，环为空时返回-1
+    int owner(std::string_view key) const {
+        if(ring_.empty()) return -1;
+        auto it = ring_.lower_bound(hash64(key));
+        if(it == ring_.end()) it = ring_.begin();
+        return it->second;
+    }
+
+    bool contains(int node) const { return nodes_.count(node) > 0; }
+    size_t size() const { return nodes_.size(); }
+    std::vector<int> nodes() const { return std::vector<int>(nodes_.begin(), nodes_.end()); }
+
+private:
+    uint64_t point(int node, int vnode) const {
+        return hash64(tag_ + "#" + std::to_string(node) + "#" + std::to_string(vnode));
+    }
+
+    int vnodes_;
+    std::string tag_;
+    std::set<int> nodes_;
+    std::map<uint64_t, int> ring_;
+};
+
+} // namespace cluster
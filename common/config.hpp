@@ -1,4 +1,5 @@
 #pragma once
+#include <cstdlib>
 #include <string>
 #include <map>
 #include <fstream>
@@ -12,6 +13,30 @@ public:
     int server_port;
     std::map<int, std::string> device_ips;  // device_id -> IP
     std::map<int, int> device_ports;         // device_id -> port
+    std::map<int, std::string> device_zones; // device_id -> zone（可选）
+    std::map<int, std::string> device_racks; // device_id -> rack（可选）
+    std::map<int, std::string> server_node_ips;  // 集群模式：node_id -> IP，为空时只有SERVER_IP一个服务器
+    std::map<int, int> server_node_ports;        // node_id -> port
+    std::string server_zone, server_rack;    // 服务器所在的zone/rack，为空时不做就近选择
+    int hash_version{1};                     // hash_to_vecZZp构造版本，所有参与方须一致
+    int device_batch_max{64};                // 设备端一批验证请求的最大条数
+    int device_batch_window_us{200};         // 设备端自适应攒批窗口的上限（微秒），0表示不等待
+    int hedge_extra{0};                      // 服务器验证时在t-1个设备之外额外发出的对冲请求数
+    int connect_timeout_ms{3000};            // 建立连接的超时（毫秒），0表示不限时
+    int read_timeout_ms{10000};              // 读取一行消息的超时
+    int write_timeout_ms{10000};             // 写出一行消息的超时
+    int idle_timeout_ms{300000};             // 服务端关闭空闲长连接的时间（没有未完成请求时），0表示不关闭
+    int request_deadline_ms{0};              // User为每个请求设定的总预算，0表示不设截止时间
+    int health_interval_ms{1000};            // 服务器后台健康探测间隔，0表示关闭探测
+    int health_timeout_ms{500};              // 单次健康探测的连接/读写超时
+    int config_reload_ms{1000};              // 轮询network.conf修改时间的间隔，0表示不热加载
+    int server_workers{4};                   // 服务器处理请求的工作线程数
+    int shard_base_port{0};                  // 分片i的内部转发端口为shard_base_port+i，0表示server_port+1000
+    int replay_window_ms{60000};             // 重放过滤器记住session2的时间窗口，0表示不检查重放
+    int replay_capacity{100000};             // 一个窗口内预期的不同请求数，决定过滤器的固定内存
+    int device_cache_size{1024};             // 设备端验证应答缓存的条目数，0表示不缓存
+    int device_cache_ttl_ms{5000};           // 缓存的应答对重试有效的时间
+    std::map<std::string, std::pair<int, int>> admit_limits;  // 请求类别 -> (并发上限, 排队上限)，未列出的类别用缺省值
     
     // 从配置文件加载
     bool load_from_file(const std::string &config_file) {
@@ -34,6 +59,60 @@ public:
                 iss >> server_ip;
             } else if (key == "SERVER_PORT") {
                 iss >> server_port;
+            } else if (key == "SERVER_ZONE") {
+                iss >> server_zone;
+            } else if (key == "SERVER_RACK") {
+                iss >> server_rack;
+            } else if (key == "HASH_VERSION") {
+                iss >> hash_version;
+            } else if (key == "CONNECT_TIMEOUT_MS") {
+                iss >> connect_timeout_ms;
+            } else if (key == "READ_TIMEOUT_MS") {
+                iss >> read_timeout_ms;
+            } else if (key == "WRITE_TIMEOUT_MS") {
+                iss >> write_timeout_ms;
+            } else if (key == "IDLE_TIMEOUT_MS") {
+                iss >> idle_timeout_ms;
+            } else if (key == "REQUEST_DEADLINE_MS") {
+                iss >> request_deadline_ms;
+            } else if (key == "CONFIG_RELOAD_MS") {
+                iss >> config_reload_ms;
+            } else if (key == "HEALTH_INTERVAL_MS") {
+                iss >> health_interval_ms;
+            } else if (key == "HEALTH_TIMEOUT_MS") {
+                iss >> health_timeout_ms;
+            } else if (key == "SHARD_BASE_PORT") {
+                iss >> shard_base_port;
+            } else if (key == "DEVICE_CACHE_SIZE") {
+                iss >> device_cache_size;
+            } else if (key == "DEVICE_CACHE_TTL_MS") {
+                iss >> device_cache_ttl_ms;
+            } else if (key == "REPLAY_WINDOW_MS") {
+                iss >> replay_window_ms;
+            } else if (key == "REPLAY_CAPACITY") {
+                iss >> replay_capacity;
+            } else if (key == "SERVER_WORKERS") {
+                iss >> server_workers;
+            } else if (key == "HEDGE_EXTRA") {
+                iss >> hedge_extra;
+            } else if (key == "DEVICE_BATCH_MAX") {
+                iss >> device_batch_max;
+            } else if (key == "DEVICE_BATCH_WINDOW_US") {
+                iss >> device_batch_window_us;
+            } else if (key == "ADMIT") {
+                // 准入控制：ADMIT <class> <max_running> <max_queued>
+                std::string cls;
+                int max_running, max_queued;
+                if (iss >> cls >> max_running >> max_queued) admit_limits[cls] = {max_running, max_queued};
+            } else if (key == "SERVER_NODE") {
+                // 集群成员：SERVER_NODE <id> <ip> <port>
+                int node_id;
+                std::string ip;
+                int port;
+                if (iss >> node_id >> ip >> port) {
+                    server_node_ips[node_id] = ip;
+                    server_node_ports[node_id] = port;
+                }
             } else if (key == "DEVICE") {
                 int device_id;
                 std::string ip;
@@ -41,6 +120,16 @@ public:
                 iss >> device_id >> ip >> port;
                 device_ips[device_id] = ip;
                 device_ports[device_id] = port;
+                
+                // 可选的拓扑属性：DEVICE <id> <ip> <port> zone=<zone> rack=<rack>
+                std::string attr;
+                while (iss >> attr) {
+                    auto eq = attr.find('=');
+                    if (eq == std::string::npos) continue;
+                    std::string name = attr.substr(0, eq), value = attr.substr(eq + 1);
+                    if (name == "zone") device_zones[device_id] = value;
+                    else if (name == "rack") device_racks[device_id] = value;
+                }
             }
         }
         
@@ -55,18 +144,86 @@ public:
         
         const char* srv_port = std::getenv("SERVER_PORT");
         if (srv_port) server_port = std::atoi(srv_port);
+        
+        const char* hash_ver = std::getenv("HASH_VERSION");
+        if (hash_ver) hash_version = std::atoi(hash_ver);
+        
+        const char* connect_to = std::getenv("CONNECT_TIMEOUT_MS");
+        if (connect_to) connect_timeout_ms = std::atoi(connect_to);
+        
+        const char* read_to = std::getenv("READ_TIMEOUT_MS");
+        if (read_to) read_timeout_ms = std::atoi(read_to);
+        
+        const char* write_to = std::getenv("WRITE_TIMEOUT_MS");
+        if (write_to) write_timeout_ms = std::atoi(write_to);
+        
+        const char* idle_to = std::getenv("IDLE_TIMEOUT_MS");
+        if (idle_to) idle_timeout_ms = std::atoi(idle_to);
+        
+        const char* deadline = std::getenv("REQUEST_DEADLINE_MS");
+        if (deadline) request_deadline_ms = std::atoi(deadline);
+        
+        const char* reload = std::getenv("CONFIG_RELOAD_MS");
+        if (reload) config_reload_ms = std::atoi(reload);
+        
+        const char* health_interval = std::getenv("HEALTH_INTERVAL_MS");
+        if (health_interval) health_interval_ms = std::atoi(health_interval);
+        
+        const char* health_timeout = std::getenv("HEALTH_TIMEOUT_MS");
+        if (health_timeout) health_timeout_ms = std::atoi(health_timeout);
+        
+        const char* shard_port = std::getenv("SHARD_BASE_PORT");
+        if (shard_port) shard_base_port = std::atoi(shard_port);
+        
+        const char* cache_size = std::getenv("DEVICE_CACHE_SIZE");
+        if (cache_size) device_cache_size = std::atoi(cache_size);
+        
+        const char* cache_ttl = std::getenv("DEVICE_CACHE_TTL_MS");
+        if (cache_ttl) device_cache_ttl_ms = std::atoi(cache_ttl);
+        
+        const char* replay_window = std::getenv("REPLAY_WINDOW_MS");
+        if (replay_window) replay_window_ms = std::atoi(replay_window);
+        
+        const char* replay_cap = std::getenv("REPLAY_CAPACITY");
+        if (replay_cap) replay_capacity = std::atoi(replay_cap);
+        
+        const char* workers = std::getenv("SERVER_WORKERS");
+        if (workers) server_workers = std::atoi(workers);
+        
+        const char* hedge = std::getenv("HEDGE_EXTRA");
+        if (hedge) hedge_extra = std::atoi(hedge);
+        
+        const char* batch_max = std::getenv("DEVICE_BATCH_MAX");
+        if (batch_max) device_batch_max = std::atoi(batch_max);
+        
+        const char* batch_window = std::getenv("DEVICE_BATCH_WINDOW_US");
+        if (batch_window) device_batch_window_us = std::atoi(batch_window);
     }
     
     // 打印配置信息
     void print() const {
         std::cout << "=== 网络配置 ===" << std::endl;
-        std::cout << "服务器: " << server_ip << ":" << server_port << std::endl;
+        std::cout << "服务器: " << server_ip << ":" << server_port;
+        if (!server_zone.empty()) std::cout << " zone=" << server_zone;
+        if (!server_rack.empty()) std::cout << " rack=" << server_rack;
+        std::cout << std::endl;
+        for (const auto &pair : server_node_ips) {
+            std::cout << "  服务器节点 " << pair.first << ": " << pair.second << ":" << server_node_ports.at(pair.first) << std::endl;
+        }
+        std::cout << "哈希版本: " << hash_version << std::endl;
+        std::cout << "对冲请求数: " << hedge_extra << std::endl;
+        std::cout << "服务器工作线程: " << server_workers << std::endl;
+        std::cout << "超时(ms): 连接 " << connect_timeout_ms << ", 读 " << read_timeout_ms
+                  << ", 写 " << write_timeout_ms << ", 空闲 " << idle_timeout_ms << ", 请求预算 " << request_deadline_ms << std::endl;
         std::cout << "设备列表:" << std::endl;
         for (const auto &pair : device_ips) {
             int dev_id = pair.first;
             std::cout << "  设备 " << dev_id << ": " 
                       << device_ips.at(dev_id) << ":" 
-                      << device_ports.at(dev_id) << std::endl;
+                      << device_ports.at(dev_id);
+            if (device_zones.count(dev_id)) std::cout << " zone=" << device_zones.at(dev_id);
+            if (device_racks.count(dev_id)) std::cout << " rack=" << device_racks.at(dev_id);
+            std::cout << std::endl;
         }
         std::cout << "=================" << std::endl;
     }
@@ -93,19 +250,24 @@ public:
 // 全局配置实例
 inline NetworkConfig g_config;
 
-// 初始化配置（优先级：环境变量 > 配置文件 > 默认值）
-inline bool init_config(const std::string &config_file = "network.conf") {
+// 加载一份配置（优先级：环境变量 > 配置文件 > 默认值），返回配置文件是否读取成功
+inline bool load_network_config(const std::string &config_file, NetworkConfig &cfg) {
     // 默认值
-    g_config.server_ip = "127.0.0.1";
-    g_config.server_port = 9000;
+    cfg.server_ip = "127.0.0.1";
+    cfg.server_port = 9000;
     
     // 尝试从配置文件加载
-    if (!g_config.load_from_file(config_file)) {
-        std::cout << "使用默认配置或环境变量" << std::endl;
-    }
+    bool ok = cfg.load_from_file(config_file);
     
     // 环境变量覆盖
-    g_config.load_from_env();
-    
+    cfg.load_from_env();
+    return ok;
+}
+
+// 初始化全局配置
+inline bool init_config(const std::string &config_file = "network.conf") {
+    if (!load_network_config(config_file, g_config)) {
+        std::cout << "使用默认配置或环境变量" << std::endl;
+    }
     return true;
-} 
\ No newline at end of file
+}
@@ -2,7 +2,9 @@
 #include <NTL/ZZ.h>
 #include <NTL/ZZ_p.h>
 #include <NTL/vec_ZZ_p.h>
+#include <openssl/crypto.h>
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include <openssl/sha.h>
 #include <vector>
@@ -12,6 +14,7 @@
 #include <stdexcept>
 #include <map>
 #include <algorithm>
+#include <cstring>
 
 using u64 = uint64_t;
 using namespace NTL;
@@ -116,6 +119,20 @@ inline u64 threshold_PRF_eval(const vec_ZZ_p &x, u64 n, u64 group_id, u64 t, u64
     return res;
 }
 
+// 基于(2,2)份额Sd/Ss的两阶段PRF计算（与user_main注册阶段一致）
+// 第一阶段分别对<x, Sd>和<x, Ss>做q -> q1舍入，合并后第二阶段q1 -> p
+inline u64 two_stage_PRF_eval(const vec_ZZ_p &x, const vec_ZZ_p &Sd, const vec_ZZ_p &Ss, u64 q, u64 q1, u64 p){
+    ZZ_p inner_Sd, inner_Ss;
+    InnerProduct(inner_Sd, x, Sd);
+    InnerProduct(inner_Ss, x, Ss);
+
+    u64 tmp3_Sd = round_toL(conv<unsigned long>(inner_Sd), q, q1);
+    u64 tmp3_Ss = round_toL(conv<unsigned long>(inner_Ss), q, q1);
+
+    u64 tmp3_sum = moduloL(tmp3_Sd + tmp3_Ss, q1);
+    return round_toL(tmp3_sum, q1, p);
+}
+
 // AES加解密函数保持不变
 inline u64 zzp_to_u64(const ZZ_p &z){
     ZZ t = rep(z);
@@ -129,35 +146,146 @@ inline void derive_aes_key_from_u64(u64 v, unsigned char out_key[32]){
     SHA256(buf, 8, out_key);
 }
 
+// 每个线程复用一个EVP_CIPHER_CTX，避免每次加解密都分配和释放上下文
+struct CipherContextPool {
+    EVP_CIPHER_CTX *ctx{nullptr};
+    const EVP_CIPHER *aes_256_cbc{nullptr};
+
+    CipherContextPool(){
+        ctx = EVP_CIPHER_CTX_new();
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        // OpenSSL 3中预先fetch算法实现，避免每次初始化时隐式查找
+        aes_256_cbc = EVP_CIPHER_fetch(NULL, "AES-256-CBC", NULL);
+#endif
+        if(!aes_256_cbc) aes_256_cbc = EVP_aes_256_cbc();
+    }
+    ~CipherContextPool(){
+        if(ctx) EVP_CIPHER_CTX_free(ctx);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+        if(aes_256_cbc != EVP_aes_256_cbc()) EVP_CIPHER_free(const_cast<EVP_CIPHER*>(aes_256_cbc));
+#endif
+    }
+    CipherContextPool(const CipherContextPool&) = delete;
+    CipherContextPool& operator=(const CipherContextPool&) = delete;
+
+    static CipherContextPool& local(){
+        thread_local CipherContextPool pool;
+        return pool;
+    }
+
+    // 取出本线程的上下文并清空上一次的状态
+    EVP_CIPHER_CTX* acquire(){
+        if(!ctx) return nullptr;
+        EVP_CIPHER_CTX_reset(ctx);
+        return ctx;
+    }
+};
+
+// 调用方提供缓冲区的AES-256-CBC接口，iv为16字节
+// 加密和解密时out都至少为in_len + 16（一个分组）字节：OpenSSL解密时也可能先写出一个分组再校验填充；
+// 返回写入长度，失败返回-1
+inline int aes_encrypt_into(const unsigned char *key32, const unsigned char *iv16,
+                            const unsigned char *in, size_t in_len, unsigned char *out){
+    CipherContextPool &pool = CipherContextPool::local();
+    EVP_CIPHER_CTX *ctx = pool.acquire(); if(!ctx) return -1;
+    int len = 0, tmplen = 0;
+    if(1 != EVP_EncryptInit_ex(ctx, pool.aes_256_cbc, NULL, key32, iv16)) return -1;
+    if(1 != EVP_EncryptUpdate(ctx, out, &len, in, (int)in_len)) return -1;
+    if(1 != EVP_EncryptFinal_ex(ctx, out + len, &tmplen)) return -1;
+    return len + tmplen;
+}
+
+inline int aes_decrypt_into(const unsigned char *key32, const unsigned char *iv16,
+                            const unsigned char *in, size_t in_len, unsigned char *out){
+    CipherContextPool &pool = CipherContextPool::local();
+    EVP_CIPHER_CTX *ctx = pool.acquire(); if(!ctx) return -1;
+    int len = 0, tmplen = 0;
+    if(1 != EVP_DecryptInit_ex(ctx, pool.aes_256_cbc, NULL, key32, iv16)) return -1;
+    if(1 != EVP_DecryptUpdate(ctx, out, &len, in, (int)in_len)) return -1;
+    if(1 != EVP_DecryptFinal_ex(ctx, out + len, &tmplen)) return -1;
+    return len + tmplen;
+}
+
+// 批量加解密条目：输入输出均由调用方提供，out_len为结果长度，失败为-1
+struct AesBatchItem {
+    const unsigned char *key32;
+    const unsigned char *iv16;
+    const unsigned char *in;
+    size_t in_len;
+    unsigned char *out;
+    int out_len;
+};
+
+// 在同一线程上下文上连续处理一批密文，返回成功的条目数
+inline size_t aes_encrypt_batch(AesBatchItem *items, size_t n){
+    size_t ok = 0;
+    for(size_t i = 0; i < n; i++){
+        items[i].out_len = aes_encrypt_into(items[i].key32, items[i].iv16, items[i].in, items[i].in_len, items[i].out);
+        if(items[i].out_len >= 0) ok++;
+    }
+    return ok;
+}
+
+inline size_t aes_decrypt_batch(AesBatchItem *items, size_t n){
+    size_t ok = 0;
+    for(size_t i = 0; i < n; i++){
+        items[i].out_len = aes_decrypt_into(items[i].key32, items[i].iv16, items[i].in, items[i].in_len, items[i].out);
+        if(items[i].out_len >= 0) ok++;
+    }
+    return ok;
+}
+
 inline bool aes_encrypt(const unsigned char *key32, const std::vector<unsigned char> &plaintext,
                         std::vector<unsigned char> &ciphertext, std::vector<unsigned char> &iv_out){
     iv_out.assign(16,0);
     if(1 != RAND_bytes(iv_out.data(), (int)iv_out.size())) return false;
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new(); if(!ctx) return false;
-    int len = 0;
-    ciphertext.assign(plaintext.size() + EVP_CIPHER_block_size(EVP_aes_256_cbc()), 0);
-    if(1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key32, iv_out.data())){ EVP_CIPHER_CTX_free(ctx); return false; }
-    if(1 != EVP_EncryptUpdate(ctx, ciphertext.data(), &len, plaintext.data(), (int)plaintext.size())){ EVP_CIPHER_CTX_free(ctx); return false; }
-    int tmplen = 0;
-    if(1 != EVP_EncryptFinal_ex(ctx, ciphertext.data()+len, &tmplen)){ EVP_CIPHER_CTX_free(ctx); return false; }
-    len += tmplen; ciphertext.resize(len);
-    EVP_CIPHER_CTX_free(ctx);
+    ciphertext.resize(plaintext.size() + 16);
+    int len = aes_encrypt_into(key32, iv_out.data(), plaintext.data(), plaintext.size(), ciphertext.data());
+    if(len < 0) return false;
+    ciphertext.resize(len);
     return true;
 }
 
 inline bool aes_decrypt(const unsigned char *key32, const std::vector<unsigned char> &ciphertext,
                         const std::vector<unsigned char> &iv, std::vector<unsigned char> &plaintext){
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new(); if(!ctx) return false;
-    int len = 0; plaintext.assign(ciphertext.size(), 0);
-    if(1 != EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key32, iv.data())){ EVP_CIPHER_CTX_free(ctx); return false; }
-    if(1 != EVP_DecryptUpdate(ctx, plaintext.data(), &len, ciphertext.data(), (int)ciphertext.size())){ EVP_CIPHER_CTX_free(ctx); return false; }
-    int tmplen = 0;
-    if(1 != EVP_DecryptFinal_ex(ctx, plaintext.data()+len, &tmplen)){ EVP_CIPHER_CTX_free(ctx); return false; }
-    len += tmplen; plaintext.resize(len);
-    EVP_CIPHER_CTX_free(ctx);
+    if(iv.size() < 16) return false;
+    plaintext.resize(ciphertext.size() + 16);
+    int len = aes_decrypt_into(key32, iv.data(), ciphertext.data(), ciphertext.size(), plaintext.data());
+    if(len < 0) return false;
+    plaintext.resize(len);
     return true;
 }
 
+// 密钥确认标签：tag = HMAC-SHA256(Kc(rw), label)，Kc = SHA256(key_label || rw)与AES密钥相互独立
+// 服务器只需一次常数时间比较即可确认候选rw，无需试解密
+constexpr size_t KEY_CONFIRM_TAG_LEN = 32;
+
+inline void derive_confirmation_key_from_u64(u64 v, unsigned char out_key[32]){
+    static const char key_label[] = "ThresholdPRF key confirmation key v1";
+    unsigned char buf[sizeof(key_label) - 1 + 8];
+    memcpy(buf, key_label, sizeof(key_label) - 1);
+    for(int i=0;i<8;i++) buf[sizeof(key_label) - 1 + i] = (v >> (8*i)) & 0xFF;
+    SHA256(buf, sizeof(buf), out_key);
+    OPENSSL_cleanse(buf, sizeof(buf));
+}
+
+inline bool derive_key_confirmation_tag(u64 rw, unsigned char out_tag[KEY_CONFIRM_TAG_LEN]){
+    static const char label[] = "ThresholdPRF key confirmation v1";
+    unsigned char key[32];
+    derive_confirmation_key_from_u64(rw, key);
+    unsigned int len = 0;
+    bool ok = HMAC(EVP_sha256(), key, (int)sizeof(key), (const unsigned char*)label, sizeof(label) - 1, out_tag, &len) != nullptr;
+    OPENSSL_cleanse(key, sizeof(key));
+    return ok && len == KEY_CONFIRM_TAG_LEN;
+}
+
+inline bool check_key_confirmation_tag(u64 rw, const std::vector<unsigned char> &stored_tag){
+    if(stored_tag.size() != KEY_CONFIRM_TAG_LEN) return false;
+    unsigned char tag[KEY_CONFIRM_TAG_LEN];
+    if(!derive_key_confirmation_tag(rw, tag)) return false;
+    return CRYPTO_memcmp(tag, stored_tag.data(), KEY_CONFIRM_TAG_LEN) == 0;
+}
+
 // 哈希函数
 inline std::string hex_print(const std::vector<unsigned char> &v){
     std::ostringstream oss; oss<<std::hex<<std::setfill('0');
@@ -165,7 +293,39 @@ inline std::string hex_print(const std::vector<unsigned char> &v){
     return oss.str();
 }
 
-inline vec_ZZ_p hash_to_vecZZp(const std::string &s, int n_vector){
+inline bool hex_decode(const std::string &hex, std::vector<unsigned char> &out){
+    if(hex.size() % 2 != 0) return false;
+    auto nibble = [](char c) -> int {
+        if(c >= '0' && c <= '9') return c - '0';
+        if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+    out.resize(hex.size() / 2);
+    for(size_t i = 0; i < out.size(); i++){
+        int hi = nibble(hex[2*i]), lo = nibble(hex[2*i+1]);
+        if(hi < 0 || lo < 0){ out.clear(); return false; }
+        out[i] = (unsigned char)((hi << 4) | lo);
+    }
+    return true;
+}
+
+// 向量哈希的构造版本，所有参与方必须使用同一版本（见network.conf中的HASH_VERSION）
+// V1：逐元素SHA-256(s || ":" || i)，保留以兼容已注册的数据
+// V2：SHAKE128一次吸收输入后扩展输出，按模数位宽拒绝采样
+enum class HashVersion { SHA256_INDEXED = 1, SHAKE128_XOF = 2 };
+
+inline HashVersion g_hash_version = HashVersion::SHA256_INDEXED;
+
+inline bool set_hash_version(int version){
+    if(version == (int)HashVersion::SHA256_INDEXED || version == (int)HashVersion::SHAKE128_XOF){
+        g_hash_version = static_cast<HashVersion>(version);
+        return true;
+    }
+    return false;
+}
+
+inline vec_ZZ_p hash_to_vecZZp_sha256(const std::string &s, int n_vector){
     vec_ZZ_p out; out.SetLength(n_vector);
     for(int i=0;i<n_vector;i++){
         std::string in = s + ":" + std::to_string(i);
@@ -176,6 +336,58 @@ inline vec_ZZ_p hash_to_vecZZp(const std::string &s, int n_vector){
     return out;
 }
 
+// SHAKE128输出长度为len时是更长输出的前缀，拒绝采样用完缓冲后可加倍重算并从原位置继续
+inline void shake128_expand(const std::string &domain, const std::string &s, std::vector<unsigned char> &out){
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if(!ctx) throw std::runtime_error("EVP_MD_CTX_new failed");
+    bool ok = 1 == EVP_DigestInit_ex(ctx, EVP_shake128(), NULL)
+           && 1 == EVP_DigestUpdate(ctx, domain.data(), domain.size())
+           && 1 == EVP_DigestUpdate(ctx, s.data(), s.size())
+           && 1 == EVP_DigestFinalXOF(ctx, out.data(), out.size());
+    EVP_MD_CTX_free(ctx);
+    if(!ok) throw std::runtime_error("SHAKE128 expansion failed");
+}
+
+inline vec_ZZ_p hash_to_vecZZp_shake128(const std::string &s, int n_vector){
+    const ZZ &modulus = ZZ_p::modulus();
+    long bits = NumBits(modulus);
+    if(bits > 63) throw std::runtime_error("hash_to_vecZZp_shake128 requires a modulus below 2^63");
+    const u64 q = conv<unsigned long>(modulus);
+    const int width = (int)((bits + 7) / 8);
+    const u64 mask = (1ULL << bits) - 1;
+
+    vec_ZZ_p out; out.SetLength(n_vector);
+    // 按拒绝概率 < 1/2 预留余量，通常一次扩展即可
+    std::vector<unsigned char> stream((size_t)n_vector * width * 5 / 4 + 64);
+    static const std::string domain = "hash_to_vecZZp/v2:";
+    shake128_expand(domain, s, stream);
+
+    size_t pos = 0;
+    for(int i = 0; i < n_vector; ){
+        if(pos + width > stream.size()){
+            stream.resize(stream.size() * 2);
+            shake128_expand(domain, s, stream);
+        }
+        u64 v = 0;
+        for(int b = 0; b < width; b++) v |= ((u64)stream[pos + b]) << (8*b);
+        pos += width;
+        v &= mask;
+        if(v >= q) continue;
+        conv(out[i], (long)v);
+        i++;
+    }
+    return out;
+}
+
+inline vec_ZZ_p hash_to_vecZZp(const std::string &s, int n_vector, HashVersion version){
+    if(version == HashVersion::SHAKE128_XOF) return hash_to_vecZZp_shake128(s, n_vector);
+    return hash_to_vecZZp_sha256(s, n_vector);
+}
+
+inline vec_ZZ_p hash_to_vecZZp(const std::string &s, int n_vector){
+    return hash_to_vecZZp(s, n_vector, g_hash_version);
+}
+
 inline ZZ_p hash_to_ZZp_single(const std::string &s){
     unsigned char digest[SHA256_DIGEST_LENGTH]; 
     SHA256((unsigned char*)s.data(), s.size(), digest);
@@ -203,68 +415,89 @@ inline void recover_2_2(const vec_ZZ_p &share1, const vec_ZZ_p &share2, vec_ZZ_p
     }
 }
 
+// 会话上下文：每个session2只计算一次H(session2)及其逆元，
+// 在α计算、βDi/βs计算和服务器端恢复之间复用
+struct SessionContext {
+    std::string session2;
+    ZZ_p h;      // H(session2)
+    ZZ_p h_inv;  // H(session2)^-1
+};
+
+inline SessionContext make_session_context(const std::string &session2){
+    SessionContext ctx;
+    ctx.session2 = session2;
+    ctx.h = hash_to_ZZp_single(session2);
+    ctx.h_inv = inv(ctx.h);
+    return ctx;
+}
+
 // 根据require.txt中的要求：α = H(pw)/session2
-inline vec_ZZ_p compute_alpha(const std::string &pw, const std::string &session2, int n_vector){
+inline vec_ZZ_p compute_alpha(const std::string &pw, const SessionContext &ctx, int n_vector){
     vec_ZZ_p pw_hash = hash_to_vecZZp(pw, n_vector);
     // 使用session2的标量哈希，统一两端实现，避免逐分量除法引入噪声
-    ZZ_p session2_scalar = hash_to_ZZp_single(session2);
+    // 除以H(session2)即乘以预先求好的逆元
     vec_ZZ_p alpha; alpha.SetLength(n_vector);
     for(int i = 0; i < n_vector; i++){
-        alpha[i] = pw_hash[i] / session2_scalar;  // 标量除法
+        mul(alpha[i], pw_hash[i], ctx.h_inv);
     }
     return alpha;
 }
 
+inline vec_ZZ_p compute_alpha(const std::string &pw, const std::string &session2, int n_vector){
+    return compute_alpha(pw, make_session_context(session2), n_vector);
+}
+
 // 设备端计算：βDi = α * SDi * session2
 // 根据tool.cpp的threshold_PRF_eval逻辑，这应该是部分PRF值乘以session2
-inline ZZ_p compute_beta_device(const vec_ZZ_p &alpha, const vec_ZZ_p &sdi, const std::string &session2,
+inline ZZ_p compute_beta_device(const vec_ZZ_p &alpha, const vec_ZZ_p &sdi, const SessionContext &ctx,
                                 u64 q, u64 q1, u64 /*p*/){
     // Inner product in field
     ZZ_p inner_product;
     InnerProduct(inner_product, alpha, sdi);
     // Multiply session2 inside field to move back to H(pw) domain
-    ZZ_p session2_elem = hash_to_ZZp_single(session2);
-    ZZ_p inner_times = inner_product * session2_elem; // equals <H(pw), SDi>
+    ZZ_p inner_times = inner_product * ctx.h; // equals <H(pw), SDi>
     // First-stage rounding q -> q1
     u64 inner_u64 = conv<unsigned long>(inner_times);
     u64 tmp3 = round_toL(inner_u64, q, q1);
     return ZZ_p(tmp3);
 }
 
+inline ZZ_p compute_beta_device(const vec_ZZ_p &alpha, const vec_ZZ_p &sdi, const std::string &session2,
+                                u64 q, u64 q1, u64 p){
+    return compute_beta_device(alpha, sdi, make_session_context(session2), q, q1, p);
+}
+
 // 服务器端计算：βs = round_toL(conv(<α, Ss> * session2), q, q1)
-inline ZZ_p compute_beta_server(const vec_ZZ_p &alpha, const vec_ZZ_p &ss, const std::string &session2, u64 q, u64 q1){
+inline ZZ_p compute_beta_server(const vec_ZZ_p &alpha, const vec_ZZ_p &ss, const SessionContext &ctx, u64 q, u64 q1){
     ZZ_p inner_product;
     InnerProduct(inner_product, alpha, ss);
     // Align domain to H(pw) by multiplying session2 in field
-    ZZ_p session2_elem = hash_to_ZZp_single(session2);
-    ZZ_p inner_times = inner_product * session2_elem; // equals <H(pw), Ss>
+    ZZ_p inner_times = inner_product * ctx.h; // equals <H(pw), Ss>
     u64 inner_u64 = conv<unsigned long>(inner_times);
     u64 tmp3 = round_toL(inner_u64, q, q1);
     return ZZ_p(tmp3);
 }
 
+inline ZZ_p compute_beta_server(const vec_ZZ_p &alpha, const vec_ZZ_p &ss, const std::string &session2, u64 q, u64 q1){
+    return compute_beta_server(alpha, ss, make_session_context(session2), q, q1);
+}
+
 // 服务器端恢复密钥rw的函数
 // 根据require.txt步骤：利用βs和设备发来的βDi恢复出密钥rw
 inline bool recover_rw_from_betas(const std::vector<ZZ_p> &betas_di, 
                                   const std::vector<int> &/*device_ids*/,
                                   const ZZ_p &beta_s,
-                                  const std::string &pw,
-                                  const std::string &session2,
-                                  int n_vector,
+                                  const std::string &/*pw*/,
+                                  const SessionContext &ctx,
+                                  int /*n_vector*/,
                                   u64 q, u64 /*q1*/, u64 p,
                                   u64 &recovered_rw){
     
-    // 计算α = H(pw)/session2
-    vec_ZZ_p alpha = compute_alpha(pw, session2, n_vector);
-    
     // 从βDi恢复设备端的份额
-    ZZ_p session2_elem = hash_to_ZZp_single(session2);
-    ZZ_p session2_inv = inv(session2_elem);
-    
     // 恢复Sd的部分：sum(βDi/session2) = sum(α * SDi)
     ZZ_p alpha_dot_Sd = ZZ_p(0);
-    for(auto beta : betas_di){
-        alpha_dot_Sd += beta * session2_inv;
+    for(const auto &beta : betas_di){
+        alpha_dot_Sd += beta * ctx.h_inv;
     }
     
     // 总的α*S = α*Sd + α*Ss = alpha_dot_Sd + beta_s
@@ -272,11 +505,6 @@ inline bool recover_rw_from_betas(const std::vector<ZZ_p> &betas_di,
     
     // 由于α = H(pw)/H(session2)，我们需要恢复<H(pw), S>
     // 这在数学上很复杂，我们尝试直接计算期望的PRF值
-    
-    // 计算H(pw)
-    vec_ZZ_p pw_hash = hash_to_vecZZp(pw, n_vector);
-    
-    // 尝试方法：假设我们能从alpha_dot_S推导出<H(pw), S>
     // 这是一个近似，实际系统中可能需要更复杂的数学
     ZZ_p estimated_inner_product = alpha_dot_S;
     
@@ -286,6 +514,18 @@ inline bool recover_rw_from_betas(const std::vector<ZZ_p> &betas_di,
     return true;
 } 
 
+inline bool recover_rw_from_betas(const std::vector<ZZ_p> &betas_di, 
+                                  const std::vector<int> &device_ids,
+                                  const ZZ_p &beta_s,
+                                  const std::string &pw,
+                                  const std::string &session2,
+                                  int n_vector,
+                                  u64 q, u64 q1, u64 p,
+                                  u64 &recovered_rw){
+    return recover_rw_from_betas(betas_di, device_ids, beta_s, pw, make_session_context(session2),
+                                 n_vector, q, q1, p, recovered_rw);
+}
+
 // ==================== 阶段四：密钥协商（LWE密钥交换）====================
 // 根据require.txt第25-31行和第58-64行的要求
 
@@ -0,0 +1,214 @@
+#pragma once
+#include <boost/asio.hpp>
+#include <sys/stat.h>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "common/cluster.hpp"
+#include "common/config.hpp"
+
+// 预解析的端点表：network.conf中的地址在加载时一次性解析成tcp::endpoint，
+// 发送路径上按设备号直接下标查找，不再做字符串解析与内存分配。
+// 表一经发布即不可变；重新加载时构建新表并原子替换（与服务器的KeyState相同，atomic_load/atomic_store），
+// 读者取得shared_ptr后在使用期间持有旧表，最后一个读者放手时旧表随之释放
+namespace endpoints {
+
+using boost::asio::ip::tcp;
+
+class EndpointTable {
+public:
+    // 由NetworkConfig构建；无法解析的地址打印错误后按未配置处理
+    static std::unique_ptr<EndpointTable> build(const NetworkConfig &cfg, uint64_t version){
+        std::unique_ptr<EndpointTable> t(new EndpointTable());
+        t->version_ = version;
+        boost::system::error_code ec;
+        auto server_addr = boost::asio::ip::make_address(cfg.server_ip, ec);
+        if(ec){
+            std::cerr << "[endpoints] Invalid server address " << cfg.server_ip << ", using 127.0.0.1" << std::endl;
+            server_addr = boost::asio::ip::address_v4::loopback();
+        }
+        t->server_ = tcp::endpoint(server_addr, (unsigned short)cfg.server_port);
+
+        for(const auto &kv : cfg.server_node_ports){
+            auto addr = boost::asio::ip::make_address(cfg.server_node_ips.at(kv.first), ec);
+            if(ec){
+                std::cerr << "[endpoints] Invalid address for server node " << kv.first << ": " << cfg.server_node_ips.at(kv.first) << std::endl;
+                continue;
+            }
+            t->server_nodes_[kv.first] = tcp::endpoint(addr, (unsigned short)kv.second);
+            t->ring_.add(kv.first);
+        }
+
+        int max_id = cfg.device_ports.empty() ? 0 : cfg.device_ports.rbegin()->first;
+        t->devices_.resize((size_t)std::max(0, max_id) + 1);
+        t->configured_.assign(t->devices_.size(), false);
+        t->tiers_.assign(t->devices_.size(), TIER_REMOTE);
+        for(const auto &kv : cfg.device_ports){
+            int id = kv.first;
+            if(id < 0) continue;
+            auto addr = boost::asio::ip::make_address(cfg.get_device_ip(id), ec);
+            if(ec){
+                std::cerr << "[endpoints] Invalid address for device " << id << ": " << cfg.get_device_ip(id) << std::endl;
+                continue;
+            }
+            t->devices_[(size_t)id] = tcp::endpoint(addr, (unsigned short)kv.second);
+            t->configured_[(size_t)id] = true;
+            t->tiers_[(size_t)id] = locality_tier(cfg, id);
+            t->device_ids_.push_back(id);
+        }
+        return t;
+    }
+
+    uint64_t version() const { return version_; }
+    const tcp::endpoint& server() const { return server_; }
+
+    // 未配置的设备沿用NetworkConfig的默认值：127.0.0.1:9100+id
+    tcp::endpoint device(int id) const {
+        if(id >= 0 && (size_t)id < devices_.size() && configured_[(size_t)id]) return devices_[(size_t)id];
+        return tcp::endpoint(boost::asio::ip::address_v4::loopback(), (unsigned short)(9100 + id));
+    }
+
+    const std::vector<int>& device_ids() const { return device_ids_; }
+
+    // 集群模式：用户按一致性哈希划分到SERVER_NODE列出的节点上，成员视图随端点表一起发布。
+    // 未配置节点时所有用户都归SERVER_IP:SERVER_PORT上的单个服务器
+    bool clustered() const { return !server_nodes_.empty(); }
+    int owner_node(const std::string &user_id) const { return ring_.owner(user_id); }
+    bool has_server_node(int id) const { return server_nodes_.count(id) > 0; }
+
+    tcp::endpoint server_node(int id) const {
+        auto it = server_nodes_.find(id);
+        return it == server_nodes_.end() ? server_ : it->second;
+    }
+
+    // 负责该用户的服务器
+    tcp::endpoint server_for(const std::string &user_id) const {
+        return clustered() ? server_node(owner_node(user_id)) : server_;
+    }
+    
+    // 设备相对服务器的距离层级，越小越近
+    static constexpr int TIER_SAME_RACK = 0;
+    static constexpr int TIER_SAME_ZONE = 1;
+    static constexpr int TIER_REMOTE = 2;   // 其他zone或拓扑未知
+    
+    int tier(int id) const {
+        if(id >= 0 && (size_t)id < tiers_.size()) return tiers_[(size_t)id];
+        return TIER_REMOTE;
+    }
+
+private:
+    EndpointTable() = default;
+
+    static int locality_tier(const NetworkConfig &cfg, int id){
+        auto zone = cfg.device_zones.find(id);
+        if(cfg.server_zone.empty() || zone == cfg.device_zones.end() || zone->second != cfg.server_zone) return TIER_REMOTE;
+        auto rack = cfg.device_racks.find(id);
+        if(!cfg.server_rack.empty() && rack != cfg.device_racks.end() && rack->second == cfg.server_rack) return TIER_SAME_RACK;
+        return TIER_SAME_ZONE;
+    }
+
+    uint64_t version_{0};
+    tcp::endpoint server_;
+    std::vector<tcp::endpoint> devices_;
+    std::vector<bool> configured_;
+    std::vector<int> tiers_;
+    std::vector<int> device_ids_;
+    std::map<int, tcp::endpoint> server_nodes_;
+    cluster::HashRing ring_;
+};
+
+namespace detail {
+    // 只通过atomic_load/atomic_store访问
+    inline std::shared_ptr<const EndpointTable>& current(){
+        static std::shared_ptr<const EndpointTable> ptr;
+        return ptr;
+    }
+}
+
+inline void publish(std::unique_ptr<EndpointTable> table){
+    std::atomic_store(&detail::current(), std::shared_ptr<const EndpointTable>(std::move(table)));
+}
+
+// 当前端点表的快照，持有期间不会被释放；须先调用init。
+// 一次请求内需要多次查表时取一次快照复用，各次查询看到同一版本
+inline std::shared_ptr<const EndpointTable> current(){
+    return std::atomic_load(&detail::current());
+}
+
+inline void init(const NetworkConfig &cfg){
+    publish(EndpointTable::build(cfg, 1));
+}
+
+// 轮询network.conf的修改时间，变化时重新加载（文件+环境变量）并发布新的端点表。
+// 只有地址表会热更新，超时等其他参数仍以启动时为准。on_reload在每次发布新表之后于监视线程上调用
+class ConfigWatcher {
+public:
+    ConfigWatcher(std::string path, int interval_ms, std::function<void()> on_reload = nullptr)
+        : path_(std::move(path)), interval_ms_(interval_ms), on_reload_(std::move(on_reload)) {
+        stamp(last_mtime_, last_size_);
+        if(interval_ms_ > 0) thread_ = std::thread([this]{ run(); });
+    }
+
+    ~ConfigWatcher(){
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        if(thread_.joinable()) thread_.join();
+    }
+
+    ConfigWatcher(const ConfigWatcher&) = delete;
+    ConfigWatcher& operator=(const ConfigWatcher&) = delete;
+
+private:
+    bool stamp(struct timespec &mtime, off_t &size) const {
+        struct stat st{};
+        if(::stat(path_.c_str(), &st) != 0) return false;
+        mtime = st.st_mtim;
+        size = st.st_size;
+        return true;
+    }
+
+    void run(){
+        while(true){
+            {
+                std::unique_lock<std::mutex> lk(mu_);
+                if(cv_.wait_for(lk, std::chrono::milliseconds(interval_ms_), [this]{ return stopping_; })) return;
+            }
+            struct timespec mtime{};
+            off_t size = 0;
+            if(!stamp(mtime, size)) continue;
+            if(mtime.tv_sec == last_mtime_.tv_sec && mtime.tv_nsec == last_mtime_.tv_nsec && size == last_size_) continue;
+            last_mtime_ = mtime;
+            last_size_ = size;
+
+            NetworkConfig cfg;
+            if(!load_network_config(path_, cfg)) continue;
+            uint64_t version = current()->version() + 1;
+            publish(EndpointTable::build(cfg, version));
+            std::cout << "[endpoints] Reloaded " << path_ << " (version " << version << ", "
+                      << current()->device_ids().size() << " devices)" << std::endl;
+            if(on_reload_) on_reload_();
+        }
+    }
+
+    std::string path_;
+    int interval_ms_;
+    std::function<void()> on_reload_;
+    struct timespec last_mtime_{};
+    off_t last_size_{0};
+    std::mutex mu_;
+    std::condition_variable cv_;
+    bool stopping_{false};
+    std::thread thread_;
+};
+
+} // namespace endpoints
@@ -0,0 +1,192 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// 设备健康状态：后台探测与实际请求的结果共同维护的存活/时延缓存，附带熔断规则
+//
+//   CLOSED    正常，请求直接放行
+//   OPEN      连续失败达到阈值，请求立即被拒绝；到达retry_at后由探测或一次试探请求重新检查
+//   HALF_OPEN 正在进行试探，其他请求仍被拒绝；试探成功回到CLOSED，失败则退避时间加倍后回到OPEN
+namespace health {
+
+using clock = std::chrono::steady_clock;
+
+enum class CircuitState { CLOSED, OPEN, HALF_OPEN };
+
+inline const char* to_string(CircuitState s){
+    switch(s){
+        case CircuitState::CLOSED: return "closed";
+        case CircuitState::OPEN: return "open";
+        case CircuitState::HALF_OPEN: return "half_open";
+    }
+    return "unknown";
+}
+
+struct DeviceHealth {
+    CircuitState state{CircuitState::CLOSED};
+    bool alive{true};              // 最近一次探测或请求是否成功
+    double rtt_ewma_ms{0};
+    int samples{0};
+    int consecutive_failures{0};
+    int backoff_ms{0};
+    clock::time_point retry_at{};
+};
+
+struct BreakerPolicy {
+    int failure_threshold{2};       // 连续失败多少次后断开
+    int initial_backoff_ms{1000};
+    int max_backoff_ms{30000};
+    double rtt_weight{0.2};
+    double failure_penalty_ms{1000};  // 选设备时每次连续失败计入的惩罚时延
+};
+
+class DeviceHealthTable {
+public:
+    explicit DeviceHealthTable(BreakerPolicy policy = BreakerPolicy()) : policy_(policy) {}
+
+    // 是否允许向该设备发请求；断开且到了重试时间时放行一次试探
+    bool allow(int device_id){
+        std::lock_guard<std::mutex> lk(mu_);
+        DeviceHealth &h = table_[device_id];
+        switch(h.state){
+            case CircuitState::CLOSED: return true;
+            case CircuitState::HALF_OPEN: return false;
+            case CircuitState::OPEN:
+                if(clock::now() < h.retry_at) return false;
+                h.state = CircuitState::HALF_OPEN;
+                return true;
+        }
+        return true;
+    }
+
+    // 只读查询，不占用试探名额
+    bool is_available(int device_id) const {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = table_.find(device_id);
+        return it == table_.end() || it->second.state == CircuitState::CLOSED;
+    }
+
+    // 探测线程据此决定本轮是否探测该设备：正常设备每轮探测，断开的设备按退避时间探测
+    bool probe_due(int device_id) const {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = table_.find(device_id);
+        if(it == table_.end() || it->second.state == CircuitState::CLOSED) return true;
+        return it->second.state == CircuitState::OPEN && clock::now() >= it->second.retry_at;
+    }
+
+    void record_success(int device_id, double rtt_ms){
+        std::lock_guard<std::mutex> lk(mu_);
+        DeviceHealth &h = table_[device_id];
+        h.rtt_ewma_ms = h.samples == 0 ? rtt_ms : (1 - policy_.rtt_weight) * h.rtt_ewma_ms + policy_.rtt_weight * rtt_ms;
+        h.samples++;
+        h.alive = true;
+        h.consecutive_failures = 0;
+        h.backoff_ms = 0;
+        h.state = CircuitState::CLOSED;
+    }
+
+    void record_failure(int device_id){
+        std::lock_guard<std::mutex> lk(mu_);
+        DeviceHealth &h = table_[device_id];
+        h.alive = false;
+        h.consecutive_failures++;
+        if(h.state == CircuitState::HALF_OPEN || h.state == CircuitState::OPEN){
+            h.backoff_ms = std::min(policy_.max_backoff_ms, std::max(policy_.initial_backoff_ms, 2 * h.backoff_ms));
+        } else if(h.consecutive_failures >= policy_.failure_threshold){
+            h.backoff_ms = policy_.initial_backoff_ms;
+        } else {
+            return;
+        }
+        h.state = CircuitState::OPEN;
+        h.retry_at = clock::now() + std::chrono::milliseconds(h.backoff_ms);
+    }
+
+    // 设备的预期时延，越小越好：RTT的EWMA加上连续失败的惩罚；还没有样本的设备记为0，保证新设备会被尝试
+    double score(int device_id) const {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = table_.find(device_id);
+        if(it == table_.end()) return 0;
+        return it->second.rtt_ewma_ms + policy_.failure_penalty_ms * it->second.consecutive_failures;
+    }
+
+    DeviceHealth get(int device_id) const {
+        std::lock_guard<std::mutex> lk(mu_);
+        auto it = table_.find(device_id);
+        return it == table_.end() ? DeviceHealth() : it->second;
+    }
+
+    std::map<int, DeviceHealth> snapshot() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        return table_;
+    }
+
+private:
+    BreakerPolicy policy_;
+    mutable std::mutex mu_;
+    std::map<int, DeviceHealth> table_;
+};
+
+// 后台探测线程：每隔interval对到期的设备调用probe(id)，probe返回true表示存活，
+// 结果与耗时写入健康表。析构时停止并等待线程退出
+class HealthProber {
+public:
+    using DeviceList = std::function<std::vector<int>()>;
+    using Probe = std::function<bool(int)>;
+
+    HealthProber(DeviceHealthTable &table, DeviceList devices, Probe probe, int interval_ms)
+        : table_(table), devices_(std::move(devices)), probe_(std::move(probe)), interval_ms_(interval_ms) {
+        if(interval_ms_ > 0) thread_ = std::thread([this]{ run(); });
+    }
+
+    ~HealthProber(){
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        if(thread_.joinable()) thread_.join();
+    }
+
+    HealthProber(const HealthProber&) = delete;
+    HealthProber& operator=(const HealthProber&) = delete;
+
+private:
+    void run(){
+        while(true){
+            for(int id : devices_()){
+                if(stopped()) return;
+                if(!table_.probe_due(id)) continue;
+                auto start = clock::now();
+                bool ok = false;
+                try { ok = probe_(id); } catch(...) { ok = false; }
+                double rtt_ms = std::chrono::duration<double, std::milli>(clock::now() - start).count();
+                if(ok) table_.record_success(id, rtt_ms);
+                else table_.record_failure(id);
+            }
+            std::unique_lock<std::mutex> lk(mu_);
+            if(cv_.wait_for(lk, std::chrono::milliseconds(interval_ms_), [this]{ return stopping_; })) return;
+        }
+    }
+
+    bool stopped(){
+        std::lock_guard<std::mutex> lk(mu_);
+        return stopping_;
+    }
+
+    DeviceHealthTable &table_;
+    DeviceList devices_;
+    Probe probe_;
+    int interval_ms_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    bool stopping_{false};
+    std::thread thread_;
+};
+
+} // namespace health
@@ -2,12 +2,89 @@
 #include <boost/asio.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include <boost/property_tree/json_parser.hpp>
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <vector>
 
 namespace net {
     using boost::asio::ip::tcp;
 
+    // 网络调用的超时（毫秒），0表示不限时；由各进程的main按配置设置
+    struct Timeouts {
+        int connect_ms{3000};
+        int read_ms{10000};
+        int write_ms{10000};
+        int idle_ms{300000};  // 服务端关闭没有未完成请求、也没有新消息的长连接
+
+        // 一次完整调用（连接、写出、等待应答）的总超时，任一项不限时则整体不限时
+        int call_ms() const {
+            if(connect_ms <= 0 || read_ms <= 0 || write_ms <= 0) return 0;
+            return connect_ms + read_ms + write_ms;
+        }
+    };
+
+    // 编译时选定的Asio事件后端：CMake选项TPRF_IO_URING打开时为io_uring，否则为epoll
+    inline const char* backend_name(){
+#if defined(BOOST_ASIO_HAS_IO_URING) && defined(BOOST_ASIO_DISABLE_EPOLL)
+        return "io_uring";
+#else
+        return "epoll";
+#endif
+    }
+
+    inline Timeouts& default_timeouts(){
+        static Timeouts timeouts;
+        return timeouts;
+    }
+
+    // 请求级截止时间。跨进程传递时只传剩余毫秒数（deadline_ms字段），避免依赖各机器时钟一致
+    class Deadline {
+    public:
+        using clock = std::chrono::steady_clock;
+
+        static Deadline none(){ return Deadline(); }
+        static Deadline after_ms(long ms){
+            Deadline d;
+            d.set_ = true;
+            d.at_ = clock::now() + std::chrono::milliseconds(std::max(0L, ms));
+            return d;
+        }
+        // 从消息的deadline_ms字段构造，字段缺失时没有截止时间
+        static Deadline from_ptree(const boost::property_tree::ptree &pt){
+            auto ms = pt.get_optional<long>("deadline_ms");
+            return ms ? after_ms(*ms) : none();
+        }
+
+        bool is_set() const { return set_; }
+        bool expired() const { return set_ && clock::now() >= at_; }
+        long remaining_ms() const {
+            if(!set_) return -1;
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(at_ - clock::now()).count();
+            return std::max<long>(0, (long)left);
+        }
+
+        // 单次操作的超时：取配置超时与剩余预算中较小者
+        int clamp(int timeout_ms) const {
+            if(!set_) return timeout_ms;
+            long left = std::max(1L, remaining_ms());
+            return timeout_ms > 0 ? (int)std::min<long>(timeout_ms, left) : (int)left;
+        }
+
+        // 转发给下游前写入剩余预算
+        void put(boost::property_tree::ptree &pt) const {
+            if(set_) pt.put("deadline_ms", remaining_ms());
+        }
+
+    private:
+        bool set_{false};
+        clock::time_point at_{};
+    };
+
     inline std::string ptree_to_json(const boost::property_tree::ptree &pt){
         std::ostringstream oss; boost::property_tree::write_json(oss, pt, false);
         std::string s = oss.str();
@@ -19,17 +96,362 @@ namespace net {
         boost::property_tree::ptree pt; boost::property_tree::read_json(iss, pt);
         return pt;
     }
-    inline std::string read_line(boost::asio::ip::tcp::socket &socket){
-        boost::asio::streambuf buf;
-        boost::asio::read_until(socket, buf, '\n');
-        std::istream is(&buf);
-        std::string line; std::getline(is, line);
-        return line;
-    }
-    inline void write_line(boost::asio::ip::tcp::socket &socket, const std::string &line){
-        std::string s = line;
-        if(s.empty() || s.back() != '\n') s.push_back('\n');
-        boost::asio::write(socket, boost::asio::buffer(s));
-    }
-}
 
+    // 不建DOM的JSON写出器，输出与ptree_to_json(write_json, pretty=false)逐字节一致：
+    // 所有标量都写成带引号的字符串，数组写成以"0","1",...为键的对象
+    class JsonWriter {
+    public:
+        JsonWriter(){ out_.reserve(256); out_.push_back('{'); first_ = true; }
+
+        JsonWriter& field(std::string_view key, std::string_view value){
+            key_prefix(key);
+            out_.push_back('"'); escape(value); out_.push_back('"');
+            return *this;
+        }
+        JsonWriter& field(std::string_view key, const char *value){ return field(key, std::string_view(value)); }
+        JsonWriter& field(std::string_view key, const std::string &value){ return field(key, std::string_view(value)); }
+        JsonWriter& field(std::string_view key, uint64_t value){
+            key_prefix(key);
+            out_.push_back('"'); append_u64(value); out_.push_back('"');
+            return *this;
+        }
+        JsonWriter& field(std::string_view key, int value){
+            key_prefix(key);
+            out_.push_back('"'); out_ += std::to_string(value); out_.push_back('"');
+            return *this;
+        }
+        // ptree把bool写成"true"/"false"
+        JsonWriter& field(std::string_view key, bool value){ return field(key, std::string_view(value ? "true" : "false")); }
+
+        JsonWriter& begin_object(std::string_view key){
+            key_prefix(key);
+            out_.push_back('{');
+            first_ = true;
+            return *this;
+        }
+        JsonWriter& end_object(){
+            out_.push_back('}');
+            first_ = false;
+            return *this;
+        }
+
+        // {"0":"v0","1":"v1",...}；get(i)返回第i个元素的u64值
+        template<class Get>
+        JsonWriter& index_array(std::string_view key, size_t n, Get &&get){
+            begin_object(key);
+            for(size_t i = 0; i < n; i++){
+                if(i) out_.push_back(',');
+                out_.push_back('"'); append_u64(i); out_ += "\":\"";
+                append_u64(get(i)); out_.push_back('"');
+            }
+            first_ = n == 0;
+            return end_object();
+        }
+        JsonWriter& index_array(std::string_view key, const std::vector<uint64_t> &v){
+            return index_array(key, v.size(), [&](size_t i){ return v[i]; });
+        }
+
+        // 结束顶层对象并返回带换行的一行
+        std::string finish(){
+            out_ += "}\n";
+            return std::move(out_);
+        }
+
+    private:
+        void key_prefix(std::string_view key){
+            if(!first_) out_.push_back(',');
+            first_ = false;
+            out_.push_back('"'); escape(key); out_ += "\":";
+        }
+        void append_u64(uint64_t v){
+            char buf[24];
+            auto res = std::to_chars(buf, buf + sizeof(buf), v);
+            out_.append(buf, res.ptr);
+        }
+        // 与boost::property_tree::json_parser::create_escapes相同的转义规则
+        void escape(std::string_view s){
+            static const char *hex = "0123456789ABCDEF";
+            for(char ch : s){
+                unsigned char c = (unsigned char)ch;
+                if(c == 0x20 || c == 0x21 || (c >= 0x23 && c <= 0x2E) || (c >= 0x30 && c <= 0x5B) || c >= 0x5D) out_.push_back(ch);
+                else if(ch == '\b') out_ += "\\b";
+                else if(ch == '\f') out_ += "\\f";
+                else if(ch == '\n') out_ += "\\n";
+                else if(ch == '\r') out_ += "\\r";
+                else if(ch == '\t') out_ += "\\t";
+                else if(ch == '/') out_ += "\\/";
+                else if(ch == '"') out_ += "\\\"";
+                else if(ch == '\\') out_ += "\\\\";
+                else { out_ += "\\u00"; out_.push_back(hex[c >> 4]); out_.push_back(hex[c & 15]); }
+            }
+        }
+
+        std::string out_;
+        bool first_{true};
+    };
+
+    // 拉取式JSON读取器：直接在输入行上顺序解析，不建树。
+    // 只支持本协议用到的形状（对象、字符串、数字、true/false/null），遇到不认识的输入返回false，
+    // 调用方据此回退到json_to_ptree，因此快速路径不会改变对异常输入的处理
+    class JsonCursor {
+    public:
+        explicit JsonCursor(std::string_view s) : s_(s) {}
+
+        bool begin_object(){
+            ws();
+            if(pos_ >= s_.size() || s_[pos_] != '{') return false;
+            pos_++;
+            first_ = true;
+            return true;
+        }
+
+        // 读取当前对象的下一个键；对象结束时消费'}'并返回false（closed()为true）
+        bool next_key(std::string_view &key){
+            ws();
+            if(pos_ >= s_.size()) return fail();
+            if(s_[pos_] == '}'){ pos_++; first_ = false; closed_ = true; return false; }
+            closed_ = false;
+            if(!first_){
+                if(s_[pos_] != ',') return fail();
+                pos_++; ws();
+            }
+            first_ = false;
+            if(!read_string_view(key, key_scratch_)) return fail();
+            ws();
+            if(pos_ >= s_.size() || s_[pos_] != ':') return fail();
+            pos_++;
+            return true;
+        }
+
+        // 上一次next_key返回false是否因为对象正常结束（而不是出错）
+        bool closed() const { return closed_ && !error_; }
+        bool ok() const { return !error_; }
+        // 当前读到的字节偏移
+        size_t position() const { return pos_; }
+
+        bool read_string(std::string &out){
+            ws();
+            if(pos_ < s_.size() && s_[pos_] == '"'){
+                std::string_view v;
+                if(!read_string_view(v, value_scratch_)) return fail();
+                out.assign(v.data(), v.size());
+                return true;
+            }
+            std::string_view lit;
+            if(!read_literal(lit)) return fail();
+            out.assign(lit.data(), lit.size());
+            return true;
+        }
+
+        // 接受"123"或123
+        bool read_u64(uint64_t &v){
+            ws();
+            bool quoted = pos_ < s_.size() && s_[pos_] == '"';
+            if(quoted) pos_++;
+            auto res = std::from_chars(s_.data() + pos_, s_.data() + s_.size(), v);
+            if(res.ec != std::errc()) return fail();
+            pos_ = (size_t)(res.ptr - s_.data());
+            if(quoted){
+                if(pos_ >= s_.size() || s_[pos_] != '"') return fail();
+                pos_++;
+            }
+            return true;
+        }
+
+        bool read_long(long &v){
+            ws();
+            bool quoted = pos_ < s_.size() && s_[pos_] == '"';
+            if(quoted) pos_++;
+            auto res = std::from_chars(s_.data() + pos_, s_.data() + s_.size(), v);
+            if(res.ec != std::errc()) return fail();
+            pos_ = (size_t)(res.ptr - s_.data());
+            if(quoted){
+                if(pos_ >= s_.size() || s_[pos_] != '"') return fail();
+                pos_++;
+            }
+            return true;
+        }
+
+        // 解析{"0":v0,"1":v1,...}到out，键必须从0开始按序出现（ptree_to_json的输出即如此）
+        bool read_index_array(std::vector<uint64_t> &out){
+            out.clear();
+            if(!begin_object()) return fail();
+            std::string_view key;
+            while(next_key(key)){
+                uint64_t idx = 0;
+                auto res = std::from_chars(key.data(), key.data() + key.size(), idx);
+                if(res.ec != std::errc() || res.ptr != key.data() + key.size() || idx != out.size()) return fail();
+                uint64_t v;
+                if(!read_u64(v)) return false;
+                out.push_back(v);
+            }
+            return closed();
+        }
+
+        bool skip_value(){
+            ws();
+            if(pos_ >= s_.size()) return fail();
+            char c = s_[pos_];
+            if(c == '"'){ std::string_view v; return read_string_view(v, value_scratch_) || fail(); }
+            if(c == '{' || c == '['){
+                char close = c == '{' ? '}' : ']';
+                pos_++;
+                bool first = true;
+                while(true){
+                    ws();
+                    if(pos_ >= s_.size()) return fail();
+                    if(s_[pos_] == close){ pos_++; return true; }
+                    if(!first){
+                        if(s_[pos_] != ',') return fail();
+                        pos_++; ws();
+                    }
+                    first = false;
+                    if(c == '{'){
+                        std::string_view k;
+                        if(!read_string_view(k, key_scratch_)) return fail();
+                        ws();
+                        if(pos_ >= s_.size() || s_[pos_] != ':') return fail();
+                        pos_++;
+                    }
+                    if(!skip_value()) return false;
+                }
+            }
+            std::string_view lit;
+            return read_literal(lit) || fail();
+        }
+
+        // 顶层对象之后只允许空白
+        bool at_end(){
+            ws();
+            return !error_ && pos_ == s_.size();
+        }
+
+    private:
+        void ws(){
+            while(pos_ < s_.size() && (s_[pos_] == ' ' || s_[pos_] == '\t' || s_[pos_] == '\n' || s_[pos_] == '\r')) pos_++;
+        }
+        bool fail(){ error_ = true; return false; }
+
+        // 数字或true/false/null
+        bool read_literal(std::string_view &lit){
+            size_t b = pos_;
+            while(pos_ < s_.size()){
+                char c = s_[pos_];
+                if((c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' || c == 'e' || c == 'E' || (c >= 'a' && c <= 'z')) pos_++;
+                else break;
+            }
+            if(pos_ == b) return false;
+            lit = s_.substr(b, pos_ - b);
+            return true;
+        }
+
+        // 没有转义时直接返回输入中的切片，否则解码到scratch
+        bool read_string_view(std::string_view &out, std::string &scratch){
+            if(pos_ >= s_.size() || s_[pos_] != '"') return false;
+            size_t b = ++pos_;
+            while(pos_ < s_.size() && s_[pos_] != '"' && s_[pos_] != '\\') pos_++;
+            if(pos_ >= s_.size()) return false;
+            if(s_[pos_] == '"'){
+                out = s_.substr(b, pos_ - b);
+                pos_++;
+                return true;
+            }
+            scratch.assign(s_.data() + b, pos_ - b);
+            while(pos_ < s_.size()){
+                char c = s_[pos_++];
+                if(c == '"'){ out = scratch; return true; }
+                if(c != '\\'){ scratch.push_back(c); continue; }
+                if(pos_ >= s_.size()) return false;
+                char e = s_[pos_++];
+                switch(e){
+                    case '"': case '\\': case '/': scratch.push_back(e); break;
+                    case 'b': scratch.push_back('\b'); break;
+                    case 'f': scratch.push_back('\f'); break;
+                    case 'n': scratch.push_back('\n'); break;
+                    case 'r': scratch.push_back('\r'); break;
+                    case 't': scratch.push_back('\t'); break;
+                    case 'u': {
+                        if(pos_ + 4 > s_.size()) return false;
+                        unsigned cp = 0;
+                        auto res = std::from_chars(s_.data() + pos_, s_.data() + pos_ + 4, cp, 16);
+                        if(res.ptr != s_.data() + pos_ + 4) return false;
+                        pos_ += 4;
+                        if(cp >= 0xD800 && cp <= 0xDFFF) return false;  // 代理对交给ptree处理
+                        if(cp < 0x80) scratch.push_back((char)cp);
+                        else if(cp < 0x800){
+                            scratch.push_back((char)(0xC0 | (cp >> 6)));
+                            scratch.push_back((char)(0x80 | (cp & 0x3F)));
+                        } else {
+                            scratch.push_back((char)(0xE0 | (cp >> 12)));
+                            scratch.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+                            scratch.push_back((char)(0x80 | (cp & 0x3F)));
+                        }
+                        break;
+                    }
+                    default: return false;
+                }
+            }
+            return false;
+        }
+
+        std::string_view s_;
+        size_t pos_{0};
+        bool first_{true};
+        bool closed_{false};
+        bool error_{false};
+        std::string key_scratch_, value_scratch_;
+    };
+
+    // 按行分帧的读缓冲区，rpc::ServerConnection与rpc::Client的每条连接各持有一个并一直复用。
+    // 换行之后已读到的字节保留给下一行，因此对端流水线发来的多条消息只需一次读取；
+    // 已确认不含换行的部分不再重复扫描
+    class LineBuffer {
+    public:
+        static constexpr size_t MAX_LINE = 64u << 20;   // 单条消息上限，防止对端不发换行时无限增长
+
+        LineBuffer(){ buf_.reserve(4096); }
+
+        LineBuffer(const LineBuffer&) = delete;
+        LineBuffer& operator=(const LineBuffer&) = delete;
+
+        // 取出下一整行（不含换行），指向内部缓冲区，下一次prepare前有效。没有完整的行时返回false
+        bool next_line(std::string_view &line){
+            size_t nl = buf_.find('\n', scan_);
+            if(nl == std::string::npos){
+                scan_ = buf_.size();
+                return false;
+            }
+            line = std::string_view(buf_.data() + rpos_, nl - rpos_);
+            rpos_ = scan_ = nl + 1;
+            return true;
+        }
+
+        // 缓冲区里是否有未取走的字节（写了一半的消息）
+        bool has_partial() const { return rpos_ < buf_.size(); }
+        bool overflow() const { return buf_.size() - rpos_ >= MAX_LINE; }
+
+        // 丢弃已取走的行，返回末尾的空闲区域供async_read_some写入；读完后须调用commit，出错时commit(0)
+        boost::asio::mutable_buffer prepare(){
+            if(rpos_ > 0){
+                buf_.erase(0, rpos_);
+                scan_ -= rpos_;
+                rpos_ = 0;
+            }
+            filled_ = buf_.size();
+            buf_.resize(std::max(buf_.capacity(), filled_ + 4096));
+            return boost::asio::buffer(&buf_[filled_], buf_.size() - filled_);
+        }
+        void commit(size_t n){ buf_.resize(filled_ + n); }
+
+        void clear(){
+            buf_.clear();
+            rpos_ = scan_ = filled_ = 0;
+        }
+
+    private:
+        std::string buf_;
+        size_t rpos_{0};    // 下一行的起点
+        size_t scan_{0};    // 已确认不含换行的位置
+        size_t filled_{0};  // prepare时已有数据的长度
+    };
+}
@@ -0,0 +1,182 @@
+#pragma once
+#include "common/crypto.hpp"
+
+// 编译期参数档案：模数q、舍入模数q1/p以及可选的固定向量长度n_vector
+// 舍入移位量和约简常数都是constexpr，每组参数实例化出各自的代码路径，
+// 替代各处硬编码的字面量以及round_toL中每次调用的浮点log2计算
+namespace params {
+
+constexpr int floor_log2(u64 x){
+    int r = -1;
+    while(x){ x >>= 1; r++; }
+    return r;
+}
+
+constexpr bool is_pow2(u64 x){
+    return x != 0 && (x & (x - 1)) == 0;
+}
+
+// 与round_toL中(int)(log2(q) - log2(p) - 1)的截断结果一致（p须为2的幂）
+constexpr int round_shift(u64 q, u64 p){
+    int raw = floor_log2(q) - floor_log2(p) - 1;
+    return (is_pow2(q) || raw >= 0) ? raw : raw + 1;
+}
+
+template<u64 From, u64 To>
+constexpr u64 round_to(u64 x){
+    if constexpr (From == To){
+        return x;
+    } else {
+        static_assert(is_pow2(To), "rounding target modulus must be a power of two");
+        constexpr int shift = round_shift(From, To);
+        static_assert(shift >= 0, "rounding target modulus must not exceed the source modulus");
+        x >>= shift;
+        u64 flag = x & 1;
+        x >>= 1;
+        return x + flag;
+    }
+}
+
+template<u64 M>
+constexpr u64 reduce(u64 x){
+    if constexpr (is_pow2(M)) return x & (M - 1);
+    else return x % M;
+}
+
+template<u64 Q, u64 Q1, u64 P, int N = 0>
+struct Profile {
+    static constexpr u64 q = Q;
+    static constexpr u64 q1 = Q1;
+    static constexpr u64 p = P;
+    static constexpr int n_vector = N;  // 0表示运行时长度
+
+    static_assert(Q1 <= Q && P <= Q1, "moduli must satisfy p <= q1 <= q");
+    static_assert(N >= 0, "n_vector must be non-negative");
+};
+
+// 当前部署使用的参数
+using DefaultProfile = Profile<2147483647, 1073741824, 65536>;
+template<int N> using DefaultProfileN = Profile<DefaultProfile::q, DefaultProfile::q1, DefaultProfile::p, N>;
+
+template<class Prof> constexpr u64 round_q_q1(u64 x){ return round_to<Prof::q, Prof::q1>(x); }
+template<class Prof> constexpr u64 round_q1_p(u64 x){ return round_to<Prof::q1, Prof::p>(x); }
+template<class Prof> constexpr u64 round_q_p(u64 x){ return round_to<Prof::q, Prof::p>(x); }
+template<class Prof> constexpr u64 mod_q1(u64 x){ return reduce<Prof::q1>(x); }
+
+// q < 2^32时乘积 < 2^64，128位累加N项不会溢出，最后只做一次约简
+template<u64 Q>
+inline u64 inner_product_u64(const vec_ZZ_p &a, const vec_ZZ_p &b, long n){
+    unsigned __int128 acc = 0;
+    for(long i = 0; i < n; i++){
+        acc += (unsigned __int128)conv<unsigned long>(rep(a[i])) * conv<unsigned long>(rep(b[i]));
+    }
+    return (u64)(acc % Q);
+}
+
+// 固定长度版本，循环次数为编译期常数以便完全展开
+template<u64 Q, int N>
+inline u64 inner_product_fixed(const vec_ZZ_p &a, const vec_ZZ_p &b){
+    unsigned __int128 acc = 0;
+    const ZZ_p *pa = a.elts(), *pb = b.elts();
+    for(int i = 0; i < N; i++){
+        acc += (unsigned __int128)conv<unsigned long>(rep(pa[i])) * conv<unsigned long>(rep(pb[i]));
+    }
+    return (u64)(acc % Q);
+}
+
+// <a, b> mod q，结果以u64返回；n_vector为0的档案按常见长度分派到固定长度内核
+template<class Prof>
+inline u64 inner_product(const vec_ZZ_p &a, const vec_ZZ_p &b){
+    if constexpr (Prof::q >= (1ULL << 32)){
+        ZZ_p r; InnerProduct(r, a, b);
+        return conv<unsigned long>(r);
+    } else if constexpr (Prof::n_vector > 0){
+        if(a.length() == Prof::n_vector && b.length() == Prof::n_vector)
+            return inner_product_fixed<Prof::q, Prof::n_vector>(a, b);
+        return inner_product_u64<Prof::q>(a, b, std::min(a.length(), b.length()));
+    } else {
+        long n = std::min(a.length(), b.length());
+        switch(n){
+            case 256:  return inner_product_fixed<Prof::q, 256>(a, b);
+            case 512:  return inner_product_fixed<Prof::q, 512>(a, b);
+            case 1024: return inner_product_fixed<Prof::q, 1024>(a, b);
+            default:   return inner_product_u64<Prof::q>(a, b, n);
+        }
+    }
+}
+
+// 把vec_ZZ_p打包成连续的u64数组，供批量内核顺序访问
+inline void pack_vec(const vec_ZZ_p &v, std::vector<u64> &out){
+    out.resize((size_t)v.length());
+    for(long i = 0; i < v.length(); i++) out[(size_t)i] = conv<unsigned long>(rep(v[i]));
+}
+
+// 一个共享向量s与K个行向量的内积：out[k] = <rows[k], s> mod q
+// 按列分块扫描，使s的当前分块和K个累加器常驻缓存，行向量各自顺序读取
+template<class Prof>
+inline void batch_inner_products(const u64 *s, size_t n, const u64 *const *rows, size_t k, u64 *out){
+    static_assert(Prof::q < (1ULL << 32), "batch kernel requires q < 2^32");
+    constexpr size_t COL_BLOCK = 512;
+    constexpr size_t ROW_BLOCK = 16;
+    for(size_t r0 = 0; r0 < k; r0 += ROW_BLOCK){
+        size_t r1 = std::min(k, r0 + ROW_BLOCK);
+        unsigned __int128 acc[ROW_BLOCK] = {};
+        for(size_t c0 = 0; c0 < n; c0 += COL_BLOCK){
+            size_t c1 = std::min(n, c0 + COL_BLOCK);
+            for(size_t r = r0; r < r1; r++){
+                const u64 *row = rows[r];
+                unsigned __int128 a = 0;
+                for(size_t c = c0; c < c1; c++) a += (unsigned __int128)row[c] * s[c];
+                acc[r - r0] += a;
+            }
+        }
+        for(size_t r = r0; r < r1; r++) out[r] = (u64)(acc[r - r0] % Prof::q);
+    }
+}
+
+inline u64 mul_mod_u64(u64 a, const ZZ_p &b, u64 q){
+    return (u64)((unsigned __int128)a * conv<unsigned long>(rep(b)) % q);
+}
+
+// 由已算好的<α, S> mod q得到β = round_toL(<α, S> * H(session2), q, q1)
+template<class Prof>
+inline u64 beta_from_inner(u64 inner, const SessionContext &ctx){
+    return round_q_q1<Prof>(mul_mod_u64(inner, ctx.h, Prof::q));
+}
+
+// βDi = round_toL(<α, SDi> * H(session2), q, q1)
+template<class Prof>
+inline ZZ_p compute_beta_device(const vec_ZZ_p &alpha, const vec_ZZ_p &sdi, const SessionContext &ctx){
+    return ZZ_p((long)beta_from_inner<Prof>(inner_product<Prof>(alpha, sdi), ctx));
+}
+
+// βs = round_toL(<α, Ss> * H(session2), q, q1)
+template<class Prof>
+inline ZZ_p compute_beta_server(const vec_ZZ_p &alpha, const vec_ZZ_p &ss, const SessionContext &ctx){
+    return compute_beta_device<Prof>(alpha, ss, ctx);
+}
+
+template<class Prof>
+inline u64 direct_PRF_eval(const vec_ZZ_p &x, const vec_ZZ_p &key){
+    return round_q_p<Prof>(inner_product<Prof>(x, key));
+}
+
+template<class Prof>
+inline u64 two_stage_PRF_eval(const vec_ZZ_p &x, const vec_ZZ_p &Sd, const vec_ZZ_p &Ss){
+    u64 tmp3_Sd = round_q_q1<Prof>(inner_product<Prof>(x, Sd));
+    u64 tmp3_Ss = round_q_q1<Prof>(inner_product<Prof>(x, Ss));
+    return round_q1_p<Prof>(mod_q1<Prof>(tmp3_Sd + tmp3_Ss));
+}
+
+// 由设备1..t-1的βDi（按设备号排序）与βs恢复rw，按threshold_PRF_eval的规则：
+// 第一个设备加、其余设备减，再加βs，最后q1 -> p。βDi与βs已是<H(pw), ·>的一级舍入值，不再含H(session2)
+template<class Prof>
+inline u64 recover_rw(const std::vector<u64> &device_betas, u64 beta_s){
+    u64 interim = 0;
+    for(size_t i = 0; i < device_betas.size(); i++){
+        interim = mod_q1<Prof>(i == 0 ? interim + device_betas[i] : interim + Prof::q1 - mod_q1<Prof>(device_betas[i]));
+    }
+    return round_q1_p<Prof>(mod_q1<Prof>(interim + beta_s));
+}
+
+} // namespace params
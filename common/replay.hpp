@@ -0,0 +1,236 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include "common/cluster.hpp"
+
+// 重放过滤器：拒绝时间窗口内重复出现的键（如 kind|user|session2），内存固定、每次查询O(1)。
+// 窗口分成GENERATIONS-1个时间片，每代一个固定大小的Bloom过滤器：插入只进当前代，查询检查所有代，
+// 每过一个时间片清空最老的一代复用为当前代。因此一个键至少被记住window_ms，至多再多一个时间片。
+// Bloom过滤器只有假阳性：新键以约FALSE_POSITIVE_RATE的概率被误判为重放，见过的键不会漏判
+namespace replay {
+
+class ReplayFilter {
+public:
+    static constexpr int GENERATIONS = 4;
+    static constexpr double FALSE_POSITIVE_RATE = 1e-6;
+
+    // 默认构造的过滤器处于关闭状态，所有键都放行
+    ReplayFilter() = default;
+
+    ReplayFilter(int window_ms, size_t capacity){ configure(window_ms, capacity); }
+
+    // window_ms为0时关闭；capacity为一个窗口内预期的不同键数，决定每代过滤器的大小
+    void configure(int window_ms, size_t capacity){
+        std::lock_guard<std::mutex> lk(mu_);
+        generations_.clear();
+        if(window_ms <= 0) return;
+        slice_ = std::chrono::milliseconds(std::max(1, window_ms / (GENERATIONS - 1)));
+        double n = (double)std::max<size_t>(1, capacity);
+        double bits = std::ceil(-n * std::log(FALSE_POSITIVE_RATE) / (std::log(2.0) * std::log(2.0)));
+        words_ = std::max<size_t>(1, ((size_t)bits + 63) / 64);
+        hashes_ = std::max(1, (int)std::lround(bits / n * std::log(2.0)));
+        generations_.assign(GENERATIONS, std::vector<uint64_t>(words_, 0));
+        current_ = 0;
+        slice_start_ = clock::now();
+    }
+
+    bool enabled() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        return !generations_.empty();
+    }
+
+    size_t memory_bytes() const {
+        std::lock_guard<std::mutex> lk(mu_);
+        return generations_.size() * words_ * sizeof(uint64_t);
+    }
+
+    // 窗口内首次出现时记下该键并返回true，重放（或假阳性）时返回false
+    bool check_and_insert(std::string_view key){
+        std::lock_guard<std::mutex> lk(mu_);
+        if(generations_.empty()) return true;
+        rotate();
+        Hashes h = hashes(key);
+        if(seen(h)) return false;
+        insert(h);
+        return true;
+    }
+
+    // 同时比较内容：键在窗口内出现过、但内容与当时相同时视为同一请求的重复（超时重试、
+    // 服务器转发用户已直接发来的请求），返回true；内容不同时才是重放，返回false。
+    // 内容键的假阳性会以约FALSE_POSITIVE_RATE的概率放行内容不同的请求，而换一个新键本来就会放行，检查不因此变弱
+    bool check_and_insert(std::string_view key, std::string_view content){
+        std::lock_guard<std::mutex> lk(mu_);
+        if(generations_.empty()) return true;
+        rotate();
+        std::string keyed;
+        keyed.reserve(key.size() + 1 + content.size());
+        keyed.append(key).push_back('\0');
+        keyed.append(content);
+        Hashes h = hashes(key), hc = hashes(keyed);
+        if(seen(hc)){
+            insert(h);
+            insert(hc);
+            return true;
+        }
+        if(seen(h)) return false;
+        insert(h);
+        insert(hc);
+        return true;
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    static uint64_t mix(uint64_t x){
+        x ^= x >> 33; x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33; x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+    }
+
+    struct Hashes { uint64_t h1, h2; };
+
+    static Hashes hashes(std::string_view key){
+        uint64_t h1 = cluster::hash64(key);
+        return {h1, mix(h1) | 1};  // 双重哈希生成hashes_个位置
+    }
+
+    bool contains(const std::vector<uint64_t> &gen, const Hashes &h) const {
+        size_t nbits = words_ * 64;
+        for(int i = 0; i < hashes_; i++){
+            size_t bit = (size_t)((h.h1 + (uint64_t)i * h.h2) % nbits);
+            if(!(gen[bit / 64] & (1ULL << (bit % 64)))) return false;
+        }
+        return true;
+    }
+
+    bool seen(const Hashes &h) const {
+        for(const auto &gen : generations_){
+            if(contains(gen, h)) return true;
+        }
+        return false;
+    }
+
+    // 只插入当前代
+    void insert(const Hashes &h){
+        auto &cur = generations_[current_];
+        size_t nbits = words_ * 64;
+        for(int i = 0; i < hashes_; i++){
+            size_t bit = (size_t)((h.h1 + (uint64_t)i * h.h2) % nbits);
+            cur[bit / 64] |= 1ULL << (bit % 64);
+        }
+    }
+
+    // 按经过的时间片数轮换，长时间空闲后最多清空全部各代
+    void rotate(){
+        auto now = clock::now();
+        auto elapsed = (now - slice_start_) / slice_;
+        if(elapsed <= 0) return;
+        for(long i = 0; i < std::min<long>((long)elapsed, GENERATIONS); i++){
+            current_ = (current_ + 1) % GENERATIONS;
+            std::fill(generations_[current_].begin(), generations_[current_].end(), 0);
+        }
+        slice_start_ += slice_ * elapsed;
+    }
+
+    mutable std::mutex mu_;
+    std::vector<std::vector<uint64_t>> generations_;
+    size_t words_{0};
+    int hashes_{0};
+    size_t current_{0};
+    clock::duration slice_{};
+    clock::time_point slice_start_{};
+};
+
+// 幂等应答缓存：超时重试和对冲请求会把同一个请求再次送到同一个进程。以请求内容的摘要为键缓存应答，
+// 在TTL内重复到达的请求直接返回缓存结果，不再计算。容量固定，满时淘汰最久未使用的条目。
+// 摘要须是密码学哈希（SHA-256），否则构造出的碰撞可以取走别人请求的结果。
+// 不加锁，只能在单个线程上使用（device_main的事件循环线程）
+class ResponseCache {
+public:
+    using Digest = std::array<unsigned char, 32>;
+
+    // 默认构造的缓存处于关闭状态
+    ResponseCache() = default;
+
+    // capacity或ttl_ms为0时关闭；重新配置会清空已缓存的应答
+    void configure(size_t capacity, int ttl_ms){
+        lru_.clear();
+        index_.clear();
+        capacity_ = capacity;
+        ttl_ = std::chrono::milliseconds(std::max(0, ttl_ms));
+    }
+
+    bool enabled() const { return capacity_ > 0 && ttl_.count() > 0; }
+    size_t size() const { return index_.size(); }
+    uint64_t hits() const { return hits_; }
+
+    std::optional<uint64_t> get(const Digest &key){
+        if(!enabled()) return std::nullopt;
+        auto it = index_.find(key);
+        if(it == index_.end()) return std::nullopt;
+        if(clock::now() >= it->second->expires){
+            lru_.erase(it->second);
+            index_.erase(it);
+            return std::nullopt;
+        }
+        lru_.splice(lru_.begin(), lru_, it->second);
+        hits_++;
+        return it->second->value;
+    }
+
+    void put(const Digest &key, uint64_t value){
+        if(!enabled()) return;
+        auto expires = clock::now() + ttl_;
+        auto it = index_.find(key);
+        if(it != index_.end()){
+            it->second->value = value;
+            it->second->expires = expires;
+            lru_.splice(lru_.begin(), lru_, it->second);
+            return;
+        }
+        if(index_.size() >= capacity_){
+            index_.erase(lru_.back().key);
+            lru_.pop_back();
+        }
+        lru_.push_front(Entry{key, value, expires});
+        index_[key] = lru_.begin();
+    }
+
+private:
+    using clock = std::chrono::steady_clock;
+
+    struct Entry {
+        Digest key;
+        uint64_t value;
+        clock::time_point expires;
+    };
+
+    // 摘要本身已均匀分布，取前8字节即可
+    struct DigestHash {
+        size_t operator()(const Digest &d) const {
+            uint64_t h;
+            std::memcpy(&h, d.data(), sizeof(h));
+            return (size_t)h;
+        }
+    };
+
+    size_t capacity_{0};
+    clock::duration ttl_{};
+    std::list<Entry> lru_;
+    std::unordered_map<Digest, std::list<Entry>::iterator, DigestHash> index_;
+    uint64_t hits_{0};
+};
+
+} // namespace replay
@@ -0,0 +1,402 @@
+#pragma once
+#include <boost/asio.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <algorithm>
+#include <charconv>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "common/net.hpp"
+
+// 多路复用RPC：请求可以带"rid"字段，应答原样带回同一个rid，
+// 于是一条长连接上可以同时有多个未完成的请求，应答按完成顺序返回而不必按发送顺序。
+// 不带rid的请求保持原有语义（每个连接一问一答），旧客户端无需修改
+namespace rpc {
+
+using boost::asio::ip::tcp;
+
+// 扫描顶层对象，取出fields中列出的字符串字段（缺失的保持原值），不构建ptree。解析失败返回false。
+// 键重复时与ptree的get一样取第一次出现的值，路由看到的用户与处理请求时看到的一致
+inline bool peek_fields(std::string_view line, std::initializer_list<std::pair<std::string_view, std::string*>> fields){
+    net::JsonCursor cur(line);
+    if(!cur.begin_object()) return false;
+    std::vector<std::string*> seen;
+    std::string_view key;
+    while(cur.next_key(key)){
+        std::string *target = nullptr;
+        for(const auto &f : fields) if(f.first == key) target = f.second;
+        if(target && std::find(seen.begin(), seen.end(), target) != seen.end()) target = nullptr;
+        if(target) seen.push_back(target);
+        if(target ? !cur.read_string(*target) : !cur.skip_value()) return false;
+    }
+    return cur.closed();
+}
+
+// 取出rid字段，没有或无法解析时返回空串
+inline std::string peek_rid(std::string_view line){
+    std::string rid;
+    return peek_fields(line, {{"rid", &rid}}) ? rid : "";
+}
+
+// 去掉消息中的rid字段（转发给下一跳前，或把下一跳的应答交回原请求方前），其余字节不变
+inline std::string untag(std::string line){
+    net::JsonCursor cur(line);
+    if(!cur.begin_object()) return line;
+    std::string_view key;
+    bool first = true;
+    while(true){
+        size_t before = cur.position();   // 第一个成员时在'{'之后，否则在前一个值之后（含其后的逗号）
+        if(!cur.next_key(key) || key == "rid"){
+            if(cur.closed() || !cur.ok() || !cur.skip_value()) return line;
+            size_t after = cur.position();
+            if(first){
+                size_t next = line.find_first_not_of(" \t\r\n", after);
+                if(next != std::string::npos && line[next] == ',') after = next + 1;
+            }
+            line.erase(before, after - before);
+            return line;
+        }
+        if(!cur.skip_value()) return line;
+        first = false;
+    }
+}
+
+// 在已序列化的对象前部插入"rid":"..."，不重新构建消息
+inline std::string tag(std::string line, std::string_view rid){
+    if(rid.empty() || line.empty() || line[0] != '{') return line;
+    std::string field = net::JsonWriter().field("rid", rid).finish();  // {"rid":"..."}\n
+    field = field.substr(1, field.size() - 3);
+    size_t body = line.find_first_not_of(" \t\r\n", 1);
+    if(body != std::string::npos && line[body] != '}') field.push_back(',');
+    line.insert(1, field);
+    return line;
+}
+
+// 把排队的消息整理成一次分散写的缓冲区列表：突发时多条消息只需一次系统调用
+inline void gather(const std::deque<std::string> &queue, std::vector<boost::asio::const_buffer> &bufs){
+    bufs.clear();
+    for(const auto &msg : queue) bufs.emplace_back(msg.data(), msg.size());
+}
+
+// 服务端一侧的连接：持续读取请求行交给handler，不等待上一个请求的应答；
+// 应答可以在任意线程、以任意顺序调用reply，按调用顺序排队，积压的应答合并成一次分散写发出。
+// 读超时约束新连接的第一条消息和写了一半的消息；之后没有未完成请求的连接空闲超过idle_ms即关闭，
+// 有请求未应答时不会因空闲关闭。写超时即关闭连接。只在连接所属io_context的单个线程上运行
+class ServerConnection : public std::enable_shared_from_this<ServerConnection> {
+public:
+    using Handler = std::function<void(const std::shared_ptr<ServerConnection>&, const std::string&)>;
+
+    ServerConnection(tcp::socket sock, Handler handler)
+        : sock_(std::move(sock)), read_timer_(sock_.get_executor()), write_timer_(sock_.get_executor()),
+          handler_(std::move(handler)) {}
+
+    void start(){ read(); }
+
+    // 线程安全
+    void reply(std::string line){
+        if(line.empty() || line.back() != '\n') line.push_back('\n');
+        auto self = shared_from_this();
+        boost::asio::post(sock_.get_executor(), [self, line = std::move(line)]() mutable {
+            self->replies_++;
+            self->out_.push_back(std::move(line));
+            if(!self->writing_) self->write();
+        });
+    }
+
+private:
+    // 每次arm或disarm都递增该计时器的代数。cancel时已经到期、回调已在排队的旧等待收不到operation_aborted，
+    // 靠代数不符识别出来，不会关掉之后重新计时的连接
+    void arm(boost::asio::steady_timer &timer, uint64_t &generation, int timeout_ms, bool idle = false){
+        uint64_t gen = ++generation;
+        if(timeout_ms <= 0) return;
+        auto self = shared_from_this();
+        timer.expires_after(std::chrono::milliseconds(timeout_ms));
+        timer.async_wait([self, &timer, &generation, gen, timeout_ms, idle](const boost::system::error_code &ec){
+            if(ec == boost::asio::error::operation_aborted || generation != gen) return;
+            if(idle && self->replies_ < self->requests_){
+                self->arm(timer, generation, timeout_ms, true);  // 仍有请求在处理，继续等待
+                return;
+            }
+            boost::system::error_code ignored;
+            self->sock_.close(ignored);
+        });
+    }
+
+    static void disarm(boost::asio::steady_timer &timer, uint64_t &generation){
+        generation++;
+        timer.cancel();
+    }
+
+    void read(){
+        auto self = shared_from_this();
+        std::string_view line;
+        while(buf_.next_line(line)){
+            requests_++;
+            handler_(self, std::string(line));
+        }
+        if(buf_.overflow()){
+            boost::system::error_code ignored;
+            sock_.close(ignored);
+            return;
+        }
+        if(requests_ == 0 || buf_.has_partial()) arm(read_timer_, read_gen_, net::default_timeouts().read_ms);
+        else arm(read_timer_, read_gen_, net::default_timeouts().idle_ms, true);
+        sock_.async_read_some(buf_.prepare(),
+            [self](const boost::system::error_code &ec, size_t n){
+                disarm(self->read_timer_, self->read_gen_);
+                self->buf_.commit(ec ? 0 : n);
+                if(ec) return;  // 对端关闭、出错或超时，连接随最后一个引用释放
+                self->read();
+            });
+    }
+
+    void write(){
+        writing_ = true;
+        sending_.clear();
+        sending_.swap(out_);
+        gather(sending_, bufs_);
+        auto self = shared_from_this();
+        arm(write_timer_, write_gen_, net::default_timeouts().write_ms);
+        boost::asio::async_write(sock_, bufs_,
+            [self](const boost::system::error_code &ec, size_t){
+                disarm(self->write_timer_, self->write_gen_);
+                self->writing_ = false;
+                if(ec){
+                    self->out_.clear();
+                    return;
+                }
+                if(!self->out_.empty()) self->write();
+            });
+    }
+
+    tcp::socket sock_;
+    boost::asio::steady_timer read_timer_, write_timer_;
+    uint64_t read_gen_{0}, write_gen_{0};
+    net::LineBuffer buf_;
+    std::deque<std::string> out_, sending_;
+    std::vector<boost::asio::const_buffer> bufs_;
+    bool writing_{false};
+    uint64_t requests_{0}, replies_{0};
+    Handler handler_;
+};
+
+// 应答句柄：记住所属连接和请求的rid，回复时自动带上rid
+struct Responder {
+    std::shared_ptr<ServerConnection> conn;
+    std::string rid;
+
+    void reply(std::string line) const { conn->reply(tag(std::move(line), rid)); }
+};
+
+// 客户端：到一个端点的单条长连接，自带一个IO线程。
+// call_async给每个请求分配rid后排队写出，应答到达时按rid找到回调；每个请求有各自的超时，
+// 超时只结束该请求，不影响同一连接上的其他请求。连接断开时所有未完成请求以错误结束，
+// 下一次调用时自动重连
+class Client {
+public:
+    // 回调在客户端的IO线程上执行，应尽快返回
+    using Callback = std::function<void(const boost::system::error_code&, std::string)>;
+
+    explicit Client(tcp::endpoint endpoint)
+        : endpoint_(std::move(endpoint)), work_(boost::asio::make_work_guard(io_)),
+          socket_(io_), connect_timer_(io_) {
+        thread_ = std::thread([this]{ io_.run(); });
+    }
+
+    ~Client(){
+        boost::asio::post(io_, [this]{
+            close(boost::asio::error::operation_aborted);
+            work_.reset();
+        });
+        thread_.join();
+    }
+
+    Client(const Client&) = delete;
+    Client& operator=(const Client&) = delete;
+
+    const tcp::endpoint& endpoint() const { return endpoint_; }
+
+    // line为不带rid的完整JSON对象；timeout_ms覆盖连接、写出与等待应答，<=0表示不限时
+    void call_async(std::string line, int timeout_ms, Callback cb){
+        boost::asio::post(io_, [this, line = std::move(line), timeout_ms, cb = std::move(cb)]() mutable {
+            uint64_t rid = next_rid_++;
+            Pending &p = pending_[rid];
+            p.cb = std::move(cb);
+            if(timeout_ms > 0){
+                p.timer.reset(new boost::asio::steady_timer(io_));
+                p.timer->expires_after(std::chrono::milliseconds(timeout_ms));
+                p.timer->async_wait([this, rid](const boost::system::error_code &ec){
+                    if(ec != boost::asio::error::operation_aborted) complete(rid, boost::asio::error::timed_out, std::string());
+                });
+            }
+            std::string framed = tag(std::move(line), std::to_string(rid));
+            if(framed.empty() || framed.back() != '\n') framed.push_back('\n');
+            outq_.push_back(std::move(framed));
+            if(state_ == State::IDLE) start_connect();
+            else if(state_ == State::OPEN && !writing_) write();
+        });
+    }
+
+    // 阻塞调用，失败时抛出boost::system::system_error
+    std::string call(std::string line, int timeout_ms){
+        auto done = std::make_shared<std::promise<std::string>>();
+        auto fut = done->get_future();
+        call_async(std::move(line), timeout_ms, [done](const boost::system::error_code &ec, std::string resp){
+            if(ec) done->set_exception(std::make_exception_ptr(boost::system::system_error(ec)));
+            else done->set_value(std::move(resp));
+        });
+        return fut.get();
+    }
+
+    boost::property_tree::ptree call(const boost::property_tree::ptree &req, int timeout_ms){
+        return net::json_to_ptree(call(net::ptree_to_json(req), timeout_ms));
+    }
+
+private:
+    enum class State { IDLE, CONNECTING, OPEN };
+
+    struct Pending {
+        Callback cb;
+        std::unique_ptr<boost::asio::steady_timer> timer;
+    };
+
+    void start_connect(){
+        state_ = State::CONNECTING;
+        uint64_t gen = ++generation_;
+        int timeout_ms = net::default_timeouts().connect_ms;
+        if(timeout_ms > 0){
+            connect_timer_.expires_after(std::chrono::milliseconds(timeout_ms));
+            connect_timer_.async_wait([this, gen](const boost::system::error_code &ec){
+                if(ec != boost::asio::error::operation_aborted && gen == generation_) close(boost::asio::error::timed_out);
+            });
+        }
+        socket_.async_connect(endpoint_, [this, gen](const boost::system::error_code &ec){
+            if(gen != generation_) return;
+            connect_timer_.cancel();
+            if(ec){
+                close(ec);
+                return;
+            }
+            boost::system::error_code ignored;
+            socket_.set_option(tcp::no_delay(true), ignored);
+            state_ = State::OPEN;
+            read();
+            if(!outq_.empty()) write();
+        });
+    }
+
+    void read(){
+        uint64_t gen = generation_;
+        socket_.async_read_some(rbuf_.prepare(), [this, gen](const boost::system::error_code &ec, size_t n){
+            if(gen != generation_) return;  // close已清空缓冲区
+            rbuf_.commit(ec ? 0 : n);
+            if(ec){
+                close(ec);
+                return;
+            }
+            std::string_view line;
+            while(rbuf_.next_line(line)){
+                std::string rid = peek_rid(line);
+                uint64_t id = 0;
+                auto res = std::from_chars(rid.data(), rid.data() + rid.size(), id);
+                if(!rid.empty() && res.ec == std::errc()) complete(id, boost::system::error_code(), std::string(line));
+                if(gen != generation_) return;  // 回调中关闭了连接
+            }
+            if(rbuf_.overflow()){
+                close(boost::asio::error::message_size);
+                return;
+            }
+            read();
+        });
+    }
+
+    void write(){
+        writing_ = true;
+        sending_.clear();
+        sending_.swap(outq_);
+        gather(sending_, bufs_);
+        uint64_t gen = generation_;
+        boost::asio::async_write(socket_, bufs_, [this, gen](const boost::system::error_code &ec, size_t){
+            if(gen != generation_) return;
+            writing_ = false;
+            if(ec){
+                close(ec);
+                return;
+            }
+            if(!outq_.empty()) write();
+        });
+    }
+
+    // 未知rid（例如已超时的请求）的应答直接丢弃
+    void complete(uint64_t rid, const boost::system::error_code &ec, std::string line){
+        auto it = pending_.find(rid);
+        if(it == pending_.end()) return;
+        Pending p = std::move(it->second);
+        pending_.erase(it);
+        if(p.timer) p.timer->cancel();
+        p.cb(ec, std::move(line));
+    }
+
+    // 关闭连接并以ec结束所有未完成请求
+    void close(const boost::system::error_code &ec){
+        generation_++;
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+        connect_timer_.cancel();
+        state_ = State::IDLE;
+        writing_ = false;
+        outq_.clear();
+        rbuf_.clear();
+        auto pending = std::move(pending_);
+        pending_.clear();
+        for(auto &kv : pending){
+            if(kv.second.timer) kv.second.timer->cancel();
+            kv.second.cb(ec, std::string());
+        }
+    }
+
+    tcp::endpoint endpoint_;
+    boost::asio::io_context io_;
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type> work_;
+    tcp::socket socket_;
+    boost::asio::steady_timer connect_timer_;
+    State state_{State::IDLE};
+    uint64_t generation_{0};     // 每次连接/断开递增，旧连接上的回调据此忽略
+    net::LineBuffer rbuf_;
+    std::deque<std::string> outq_, sending_;   // sending_为正在写出的一批，写完前保持存活
+    std::vector<boost::asio::const_buffer> bufs_;
+    bool writing_{false};
+    uint64_t next_rid_{1};
+    std::unordered_map<uint64_t, Pending> pending_;
+    std::thread thread_;
+};
+
+// 按端点共享的客户端：同一进程内到同一端点的调用复用一条连接
+class ClientPool {
+public:
+    std::shared_ptr<Client> get(const tcp::endpoint &endpoint){
+        std::lock_guard<std::mutex> lk(mu_);
+        auto &client = clients_[endpoint];
+        if(!client) client = std::make_shared<Client>(endpoint);
+        return client;
+    }
+
+private:
+    std::mutex mu_;
+    std::map<tcp::endpoint, std::shared_ptr<Client>> clients_;
+};
+
+inline ClientPool& clients(){
+    static ClientPool pool;
+    return pool;
+}
+
+} // namespace rpc
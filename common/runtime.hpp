@@ -0,0 +1,189 @@
+#pragma once
+#include <NTL/ZZ.h>
+#include <NTL/ZZ_p.h>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "common/params.hpp"
+
+// 密码运算运行时：管理NTL的ZZ_p模数上下文
+// NTL的ZZ_p模数是线程局部状态，新建的线程默认没有模数，
+// 所有要做域运算的线程都必须先安装对应的ModulusDomain
+namespace crypto_runtime {
+
+class ModulusDomain;
+
+// 记录当前线程安装的域，用于调试构建下的校验
+inline const ModulusDomain*& thread_domain(){
+    thread_local const ModulusDomain *domain = nullptr;
+    return domain;
+}
+
+class ModulusDomain {
+public:
+    explicit ModulusDomain(u64 q) : q_(q), ctx_(ZZ((unsigned long)q)) {}
+
+    ModulusDomain(const ModulusDomain&) = delete;
+    ModulusDomain& operator=(const ModulusDomain&) = delete;
+
+    u64 modulus() const { return q_; }
+    const ZZ_pContext& context() const { return ctx_; }
+
+    // 在当前线程安装本域的模数
+    void install() const {
+        ctx_.restore();
+        thread_domain() = this;
+    }
+
+    bool installed_here() const { return thread_domain() == this; }
+
+private:
+    u64 q_;
+    ZZ_pContext ctx_;
+};
+
+// 定义TPRF_CHECK_DOMAIN（CMake选项同名）时校验当前线程安装的是期望的域，否则为空操作。
+// 不跟随NDEBUG：CMakeLists缺省不定义NDEBUG，默认构建不应在每个任务上付出这次比较
+inline void assert_domain(const ModulusDomain &domain){
+#ifdef TPRF_CHECK_DOMAIN
+    if(!domain.installed_here() || ZZ_p::modulus() != ZZ((unsigned long)domain.modulus())){
+        const ModulusDomain *cur = thread_domain();
+        std::fprintf(stderr, "[crypto_runtime] thread is using modulus %llu, expected %llu\n",
+                     cur ? (unsigned long long)cur->modulus() : 0ULL,
+                     (unsigned long long)domain.modulus());
+        std::abort();
+    }
+#else
+    (void)domain;
+#endif
+}
+
+// 作用域内临时切换到另一个域，离开时恢复原模数
+class ScopedDomain {
+public:
+    explicit ScopedDomain(const ModulusDomain &domain) : prev_(thread_domain()) {
+        bak_.save();
+        domain.install();
+    }
+    ~ScopedDomain(){
+        bak_.restore();
+        thread_domain() = prev_;
+    }
+    ScopedDomain(const ScopedDomain&) = delete;
+    ScopedDomain& operator=(const ScopedDomain&) = delete;
+
+private:
+    ZZ_pBak bak_;
+    const ModulusDomain *prev_;
+};
+
+// 进程默认域（params::DefaultProfile::q），各可执行程序的主线程在启动时安装
+inline const ModulusDomain& default_domain(){
+    static const ModulusDomain domain(params::DefaultProfile::q);
+    return domain;
+}
+
+class WorkerPool;
+
+// 当前线程所属的线程池，非工作线程为nullptr
+inline const WorkerPool*& thread_pool(){
+    thread_local const WorkerPool *pool = nullptr;
+    return pool;
+}
+
+// 绑定到一个域的工作线程池：每个工作线程启动时安装该域的模数，
+// 定义TPRF_CHECK_DOMAIN时执行每个任务前重新校验。不同的池可以使用不同的模数
+class WorkerPool {
+public:
+    WorkerPool(const ModulusDomain &domain, unsigned n_threads) : domain_(domain) {
+        if(n_threads == 0) n_threads = std::max(1u, std::thread::hardware_concurrency());
+        for(unsigned i = 0; i < n_threads; i++){
+            threads_.emplace_back([this]{ run(); });
+        }
+    }
+
+    ~WorkerPool(){
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        for(auto &th : threads_) th.join();
+    }
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    const ModulusDomain& domain() const { return domain_; }
+    size_t size() const { return threads_.size(); }
+
+    template<class F>
+    auto submit(F &&fn) -> std::future<decltype(fn())> {
+        using R = decltype(fn());
+        auto task = std::make_shared<std::packaged_task<R()>>(std::forward<F>(fn));
+        std::future<R> fut = task->get_future();
+        {
+            std::lock_guard<std::mutex> lk(mu_);
+            queue_.emplace_back([task]{ (*task)(); });
+        }
+        cv_.notify_one();
+        return fut;
+    }
+
+    bool on_worker_thread() const { return thread_pool() == this; }
+
+    // 把[0, n)切成若干连续区间并行执行，阻塞直到全部完成。
+    // 在本池的工作线程上调用时直接串行执行：该线程阻塞等待时占着一个工作线程，
+    // 所有工作线程都这样等待时提交的区间永远不会被执行。
+    // 某个区间抛出异常时先等其余区间全部结束（它们引用着调用方的fn），再重新抛出第一个异常
+    void parallel_for(size_t n, const std::function<void(size_t, size_t)> &fn){
+        if(n == 0) return;
+        if(on_worker_thread()){
+            fn(0, n);
+            return;
+        }
+        size_t parts = std::min(n, threads_.size());
+        size_t step = (n + parts - 1) / parts;
+        std::vector<std::future<void>> futs;
+        for(size_t begin = 0; begin < n; begin += step){
+            size_t end = std::min(n, begin + step);
+            futs.push_back(submit([&fn, begin, end]{ fn(begin, end); }));
+        }
+        for(auto &f : futs) f.wait();
+        for(auto &f : futs) f.get();
+    }
+
+private:
+    void run(){
+        domain_.install();
+        thread_pool() = this;
+        while(true){
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lk(mu_);
+                cv_.wait(lk, [this]{ return stopping_ || !queue_.empty(); });
+                if(queue_.empty()) return;
+                job = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            assert_domain(domain_);
+            job();
+        }
+    }
+
+    const ModulusDomain &domain_;
+    std::vector<std::thread> threads_;
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> queue_;
+    bool stopping_{false};
+};
+
+} // namespace crypto_runtime
@@ -6,6 +6,9 @@
 #include <vector>
 #include <set>
 #include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <memory>
 
 using u64 = uint64_t;
 using namespace NTL;
@@ -125,37 +128,170 @@ inline bool recoverSecret_t1_n1(int t, const std::map<int, vec_ZZ_p> &selected_s
     return true;
 }
 
+// 稠密设备位图：设备号即位下标，置位/清位/测试均为O(1)，计数用popcount维护
+class DeviceBitmap {
+public:
+    DeviceBitmap() = default;
+    explicit DeviceBitmap(int max_id) : words_((size_t)std::max(0, max_id) / 64 + 1, 0) {}
+    
+    bool test(int id) const {
+        if(id < 0 || (size_t)id / 64 >= words_.size()) return false;
+        return (words_[(size_t)id / 64] >> (id % 64)) & 1;
+    }
+    
+    // 返回位是否发生变化
+    bool set(int id){
+        if(id < 0) return false;
+        if((size_t)id / 64 >= words_.size()) words_.resize((size_t)id / 64 + 1, 0);
+        uint64_t &w = words_[(size_t)id / 64];
+        uint64_t bit = 1ULL << (id % 64);
+        if(w & bit) return false;
+        w |= bit; count_++;
+        return true;
+    }
+    
+    bool reset(int id){
+        if(!test(id)) return false;
+        words_[(size_t)id / 64] &= ~(1ULL << (id % 64));
+        count_--;
+        return true;
+    }
+    
+    size_t count() const { return count_; }
+    bool empty() const { return count_ == 0; }
+    
+    // 按设备号从小到大遍历置位的设备，fn返回false时提前结束
+    template<class F>
+    void for_each(F &&fn) const {
+        for(size_t i = 0; i < words_.size(); i++){
+            uint64_t w = words_[i];
+            while(w){
+                int id = (int)(i * 64 + (size_t)__builtin_ctzll(w));
+                if(!fn(id)) return;
+                w &= w - 1;
+            }
+        }
+    }
+    
+    std::vector<int> to_vector() const {
+        std::vector<int> out;
+        out.reserve(count_);
+        for_each([&](int id){ out.push_back(id); return true; });
+        return out;
+    }
+    
+private:
+    std::vector<uint64_t> words_;
+    size_t count_{0};
+};
+
+// 某一时刻设备集合的只读快照，epoch随每次撤销递增；以shared_ptr共享，无需复制位图
+struct DeviceSetSnapshot {
+    uint64_t epoch{0};
+    DeviceBitmap active;
+    DeviceBitmap revoked;
+};
+
+// shareSecret_t1_n1的份额能否任取t-1个恢复Sd：t=2时每个设备都持有Sd，可以任取；
+// t>2时设备1持有Sd加全部随机份额，设备2..t-1各持有一个随机份额，其余是零份额，只有设备1..t-1能恢复
+inline bool shares_interchangeable(int t){ return t <= 2; }
+
+// 从活跃设备集合中选择count个设备：先按距离层级tier（同rack < 同zone < 其他，未给出时视为相同），
+// 再按预期时延score从小到大（未给出时视为相同），最后按设备号。只要近处设备够用就不会选到远处设备，
+// 不够时用最快的远处设备补足。usable可排除暂时不可达的设备。
+// 时延统计不在这里维护，由调用方从设备健康表取得
+inline std::vector<int> select_devices(const DeviceBitmap &active, int count,
+                                       const std::function<bool(int)> &usable = nullptr,
+                                       const std::function<int(int)> &tier = nullptr,
+                                       const std::function<double(int)> &score = nullptr){
+    std::vector<int> active_list = active.to_vector();
+    if(usable) active_list.erase(std::remove_if(active_list.begin(), active_list.end(),
+                                                [&](int id){ return !usable(id); }), active_list.end());
+    auto faster = [&](int a, int b){
+        int ta = tier ? tier(a) : 0, tb = tier ? tier(b) : 0;
+        if(ta != tb) return ta < tb;
+        double sa = score ? score(a) : 0, sb = score ? score(b) : 0;
+        return sa < sb || (sa == sb && a < b);
+    };
+    if(count < 0) count = 0;
+    if(active_list.size() > static_cast<size_t>(count)){
+        std::partial_sort(active_list.begin(), active_list.begin() + count, active_list.end(), faster);
+        active_list.resize(count);
+    } else {
+        std::sort(active_list.begin(), active_list.end(), faster);
+    }
+    return active_list;
+}
+
+// 验证时向哪些设备请求βDi：份额可互换（t=2）时按select_devices选出1个，另加extra个对冲请求；
+// t>2时只能是设备1..t-1，不按时延或距离重排、不过滤、不对冲，其中有设备已被撤销时返回的设备不足t-1个
+inline std::vector<int> verification_devices(const DeviceBitmap &active, int t, int extra,
+                                             const std::function<bool(int)> &usable = nullptr,
+                                             const std::function<int(int)> &tier = nullptr,
+                                             const std::function<double(int)> &score = nullptr){
+    if(shares_interchangeable(t)) return select_devices(active, t - 1 + std::max(0, extra), usable, tier, score);
+    std::vector<int> out;
+    for(int id = 1; id <= t - 1; id++){
+        if(active.test(id)) out.push_back(id);
+    }
+    return out;
+}
+
 // 设备撤销管理器
 struct DeviceManager {
-    std::set<int> active_devices;
-    std::set<int> revoked_devices;
+    DeviceBitmap active_devices;
+    DeviceBitmap revoked_devices;
+    uint64_t epoch{0};  // 设备集合版本号，每次撤销递增
     int n_devices;
     int threshold;
     
-    DeviceManager(int n, int t) : n_devices(n), threshold(t) {
+    DeviceManager(int n, int t) : active_devices(n), revoked_devices(n), n_devices(n), threshold(t) {
         for(int i = 1; i <= n_devices; i++){
-            active_devices.insert(i);
+            active_devices.set(i);
         }
     }
     
+    // 从某个快照继续修改，用于在不可变的设备集合上准备下一个版本
+    DeviceManager(int n, int t, const DeviceSetSnapshot &from)
+        : active_devices(from.active), revoked_devices(from.revoked), epoch(from.epoch), n_devices(n), threshold(t) {}
+    
     void revokeDevice(int device_id){
-        active_devices.erase(device_id);
-        revoked_devices.insert(device_id);
+        if(device_id < 1 || device_id > n_devices) return;
+        bool changed = active_devices.reset(device_id);
+        changed |= revoked_devices.set(device_id);
+        if(changed) epoch++;
     }
     
+    bool isActive(int device_id) const { return active_devices.test(device_id); }
+    bool isRevoked(int device_id) const { return revoked_devices.test(device_id); }
+    
     std::vector<int> getActiveDevices() const {
-        return std::vector<int>(active_devices.begin(), active_devices.end());
+        return active_devices.to_vector();
     }
     
     bool canOperate() const {
-        return active_devices.size() >= static_cast<size_t>(threshold - 1);  // 需要t-1个设备
+        return active_devices.count() >= static_cast<size_t>(threshold - 1);  // 需要t-1个设备
     }
     
-    std::vector<int> selectDevicesForVerification(int count) const {
-        std::vector<int> active_list(active_devices.begin(), active_devices.end());
-        if(active_list.size() < static_cast<size_t>(count)) return active_list;
-        
-        // 简单选择前count个活跃设备
-        return std::vector<int>(active_list.begin(), active_list.begin() + count);
+    // 当前设备集合的共享快照，epoch未变时重复返回同一个对象
+    std::shared_ptr<const DeviceSetSnapshot> snapshot() const {
+        if(!snapshot_ || snapshot_->epoch != epoch){
+            auto snap = std::make_shared<DeviceSetSnapshot>();
+            snap->epoch = epoch;
+            snap->active = active_devices;
+            snap->revoked = revoked_devices;
+            snapshot_ = std::move(snap);
+        }
+        return snapshot_;
     }
+    
+    // 选择验证用的设备（t-1个，另加extra个对冲请求），规则见verification_devices
+    std::vector<int> selectDevicesForVerification(int extra = 0, const std::function<bool(int)> &usable = nullptr,
+                                                  const std::function<int(int)> &tier = nullptr,
+                                                  const std::function<double(int)> &score = nullptr) const {
+        return verification_devices(active_devices, threshold, extra, usable, tier, score);
+    }
+    
+private:
+    mutable std::shared_ptr<const DeviceSetSnapshot> snapshot_;
 }; 
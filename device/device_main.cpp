@@ -2,204 +2,618 @@
 #include <boost/asio.hpp>
 #include <boost/property_tree/ptree.hpp>
 #include "common/crypto.hpp"
+#include "common/params.hpp"
+#include "common/runtime.hpp"
 #include "common/share.hpp"
 #include "common/net.hpp"
 #include "common/config.hpp"
+#include "common/rpc.hpp"
+#include "common/replay.hpp"
 
 using namespace std;
 using namespace NTL;
 using boost::asio::ip::tcp;
+using Params = params::DefaultProfile;
 
-struct DeviceState {
-    int device_id{};
+// 设备在某个份额epoch下的份额。撤销分两个阶段：key_update把下一个epoch的份额暂存起来，
+// 旧份额继续为当前epoch的验证服务；服务器发布新epoch之后由key_commit提交，
+// 或由第一条带新epoch的验证请求提交。中途放弃的撤销由key_abort丢弃暂存的份额
+struct ShareVersion {
+    vec_ZZ_p SDi;  // 设备的秘密份额
+    vector<u64> SDi_packed;  // SDi的打包副本，供批量验证内核使用
+    bool revoked{false};  // 从该epoch起设备被撤销，不再持有份额
+};
+
+// 设备为每个用户保存份额，按请求中的user字段索引（缺省为"default"）
+struct DeviceUserState {
     int n_vector{};
     int t{};
-    vec_ZZ_p SDi;  // 设备的秘密份额
-    bool is_revoked{false};
+    uint64_t generation{0};  // 每次注册递增，使旧份额算出的缓存应答失效
+    uint64_t committed_epoch{0};  // 不带share_epoch的请求使用的epoch
+    map<uint64_t, ShareVersion> shares;  // 已提交的epoch及其前一个（供仍在途的旧epoch验证），以及暂存的下一个
     string last_session1{"1"};  // 默认为"1"表示被撤销
+
+    bool is_revoked() const {
+        auto it = shares.find(committed_epoch);
+        return it == shares.end() || it->second.revoked;
+    }
+
+    // 提交epoch，只保留它与前一个epoch；被撤销的设备丢弃全部份额
+    void commit(uint64_t epoch){
+        if(epoch <= committed_epoch || !shares.count(epoch)) return;
+        committed_epoch = epoch;
+        bool revoked = shares[epoch].revoked;
+        for(auto it = shares.begin(); it != shares.end();){
+            bool keep = it->first == epoch || (!revoked && it->first + 1 == epoch);
+            it = keep ? std::next(it) : shares.erase(it);
+        }
+    }
+
+    // 按请求的epoch取份额：请求暂存的epoch说明服务器已发布它，先提交。没有对应份额时返回nullptr
+    const ShareVersion* share_for(uint64_t epoch){
+        if(epoch > committed_epoch) commit(epoch);
+        auto it = shares.find(epoch);
+        return it == shares.end() ? nullptr : &it->second;
+    }
 };
 
-int main(int argc, char* argv[]){
-    if(argc < 2){ cerr<<"Usage: device_main <device_id>\n"; return 1; }
-    int device_id = atoi(argv[1]);
-    
-    // 初始化网络配置
-    init_config("network.conf");
-    cout<<"[Device "<<device_id<<"] 配置的监听端口: "<<g_config.get_device_port(device_id)<<"\n";
-    
-    ZZ_p::init(ZZ(2147483647));
-    cout<<"[Device "<<device_id<<"] Starting device server\n";
-    
-    boost::asio::io_context io;
-    tcp::acceptor acceptor(io, tcp::endpoint(tcp::v4(), g_config.get_device_port(device_id)));
-    
-    DeviceState state;
-    state.device_id = device_id;
-    
-    while(true){
-        tcp::socket sock(io);
-        acceptor.accept(sock);
-        string line = net::read_line(sock);
-        auto pt = net::json_to_ptree(line);
-        string kind = pt.get<string>("kind", "");
-        
-        if(kind == "register_device"){
-            // 一：注册阶段 - 从User那里收到自己的秘密份额SDi
-            cout<<"\n=== [Device "<<device_id<<"] Registration Phase ===\n";
-            
-            state.device_id = pt.get<int>("device_id");
-            state.n_vector = pt.get<int>("n_vector");
-            state.t = pt.get<int>("t");
-            
-            // 接收SDi
-            auto sdi_pt = pt.get_child("SDi");
-            state.SDi.SetLength(state.n_vector);
-            for(int i = 0; i < state.n_vector; i++){
-                unsigned long ul = sdi_pt.get<unsigned long>(to_string(i));
-                state.SDi[i] = conv<ZZ_p>(ZZ(ul));
+struct DeviceState {
+    int device_id{};
+    map<string, DeviceUserState> users;
+
+    DeviceUserState* find_user(const string &user_id){
+        auto it = users.find(user_id);
+        return it == users.end() ? nullptr : &it->second;
+    }
+};
+
+// 验证应答缓存：内容完全相同的请求（同一用户、份额、session2与alpha）在TTL内直接返回已算出的β，
+// 超时重试以及用户与服务器先后为同一session2发来的请求都不增加计算量。
+// 键里带上注册代数与份额epoch，重新注册或换用其他epoch的份额时旧的β不会被返回
+static replay::ResponseCache g_response_cache;
+
+// alpha须已约简到[0, q)，与送入批量内核的值一致
+static replay::ResponseCache::Digest verification_digest(const string &user_id, uint64_t generation, uint64_t share_epoch,
+                                                         const string &session2, const vector<u64> &alpha){
+    string buf;
+    buf.reserve(user_id.size() + session2.size() + 8 * (alpha.size() + 2) + 2);
+    auto put_u64 = [&buf](uint64_t v){ for(int i = 0; i < 8; i++) buf.push_back((char)((v >> (8 * i)) & 0xFF)); };
+    buf.append(user_id).push_back('\0');
+    put_u64(generation);
+    put_u64(share_epoch);
+    buf.append(session2).push_back('\0');
+    for(u64 a : alpha) put_u64(a);
+    replay::ResponseCache::Digest d;
+    SHA256((const unsigned char*)buf.data(), buf.size(), d.data());
+    return d;
+}
+
+static void reply_beta(const rpc::Responder &out, u64 beta){
+    out.reply(net::JsonWriter()
+        .field("kind", "verification_response")
+        .field("beta", (uint64_t)beta)
+        .finish());
+}
+
+static void reply_deadline_exceeded(const rpc::Responder &out){
+    out.reply(net::JsonWriter().field("kind", "verification_response").field("error", "deadline_exceeded").finish());
+}
+
+// 已解析、等待批量计算的验证请求
+struct PendingVerification {
+    rpc::Responder out;
+    string user_id;
+    uint64_t share_epoch{};  // 计算时使用的份额epoch
+    string session2;
+    vector<u64> alpha;
+    net::Deadline deadline;
+    replay::ResponseCache::Digest digest{};
+};
+
+// 验证请求攒批：同一轮事件循环里已经读到的请求总是一起计算；
+// 连续出现多条请求的批次时把等待窗口加倍（不超过上限），只有单条请求时窗口减半直至为0，
+// 轻负载下不引入额外延迟，重负载下用窗口换取更大的批次。
+// 还在攒批中的请求按摘要登记，内容相同的请求到达时挂到它上面，算出后一起应答，不会被当成重放
+class VerificationBatcher {
+public:
+    VerificationBatcher(boost::asio::io_context &io, DeviceState &state, size_t batch_max, long max_window_us)
+        : io_(io), timer_(io), state_(state),
+          batch_max_(max<size_t>(1, batch_max)), max_window_us_(max(0L, max_window_us)) {}
+
+    // 有摘要相同的请求尚未应答时挂上out并返回true
+    bool attach(const replay::ResponseCache::Digest &digest, const rpc::Responder &out){
+        auto it = inflight_.find(digest);
+        if(it == inflight_.end()) return false;
+        it->second.push_back(out);
+        return true;
+    }
+
+    void submit(PendingVerification item){
+        inflight_[item.digest];
+        pending_.push_back(move(item));
+        if(pending_.size() >= batch_max_){
+            timer_.cancel();
+            post_flush();
+        } else if(!scheduled_){
+            scheduled_ = true;
+            if(window_us_ == 0){
+                post_flush();
+            } else {
+                timer_.expires_after(chrono::microseconds(window_us_));
+                timer_.async_wait([this](const boost::system::error_code &ec){
+                    if(ec != boost::asio::error::operation_aborted) flush();
+                });
             }
-            
-            cout<<"Received SDi: ";
-            for(int i = 0; i < state.n_vector; i++) cout<<rep(state.SDi[i])<<" ";
-            cout<<"\n";
-            
-            boost::property_tree::ptree reply;
-            reply.put("kind", "register_ack");
-            reply.put("ok", 1);
-            net::write_line(sock, net::ptree_to_json(reply));
-            
-            cout<<"[Device "<<device_id<<"] Registration completed.\n";
-            
-        } else if(kind == "verification_request"){
-            // 二：验证阶段
-            cout<<"\n=== [Device "<<device_id<<"] Verification Phase ===\n";
-            
-            if(state.is_revoked){
-                cout<<"Device is revoked, rejecting verification request.\n";
-                boost::property_tree::ptree reply;
-                reply.put("kind", "verification_response");
-                reply.put("error", "device_revoked");
-                net::write_line(sock, net::ptree_to_json(reply));
+        }
+    }
+
+private:
+    void post_flush(){
+        boost::asio::post(io_, [this]{ flush(); });
+    }
+
+    void flush(){
+        scheduled_ = false;
+        if(pending_.empty()) return;
+
+        vector<PendingVerification> batch;
+        batch.swap(pending_);
+        if(batch.size() > batch_max_){
+            // 超出部分留到下一批
+            pending_.assign(make_move_iterator(batch.begin() + batch_max_), make_move_iterator(batch.end()));
+            batch.resize(batch_max_);
+            scheduled_ = true;
+            post_flush();
+        }
+
+        // 按用户和份额epoch分组，每组用同一份额做一次多行内积
+        map<pair<string, uint64_t>, vector<size_t>> groups;
+        for(size_t i = 0; i < batch.size(); i++) groups[{batch[i].user_id, batch[i].share_epoch}].push_back(i);
+
+        for(auto &g : groups){
+            DeviceUserState *user = state_.find_user(g.first.first);
+            const ShareVersion *share = user ? user->share_for(g.first.second) : nullptr;
+            if(!share || share->revoked){
+                const char *error = !user ? "unknown_user" : !share ? "stale_epoch" : "device_revoked";
+                for(size_t i : g.second) reply_error(batch[i], error);
                 continue;
             }
-            
-            // 1. 接收session2和α值
-            string session2 = pt.get<string>("session2");
-            cout<<"Received session2: "<<session2<<"\n";
-            
-            auto alpha_pt = pt.get_child("alpha");
-            vec_ZZ_p alpha; alpha.SetLength(state.n_vector);
-            for(int i = 0; i < state.n_vector; i++){
-                unsigned long ul = alpha_pt.get<unsigned long>(to_string(i));
-                alpha[i] = conv<ZZ_p>(ZZ(ul));
+            // 攒批期间已过截止时间的请求不再计算，除非还有挂在它上面的重试在等
+            vector<size_t> live;
+            for(size_t i : g.second){
+                bool expired = batch[i].deadline.expired();
+                if(expired && inflight_[batch[i].digest].empty()) reply_error(batch[i], "deadline_exceeded");
+                else live.push_back(i);
             }
-            
-            cout<<"Received alpha: ";
-            for(int i = 0; i < state.n_vector; i++) cout<<rep(alpha[i])<<" ";
-            cout<<"\n";
-            
-            // 2. 计算βDi = α * SDi * session2（根据require.txt第40行）
-            // 使用正确的PRF计算方式
-            ZZ_p beta_di = compute_beta_device(alpha, state.SDi, session2, 2147483647, 1073741824, 65536);
-            cout<<"Computed beta_di: "<<rep(beta_di)<<"\n";
-            
-            // 3. 将βDi发给User
+            if(live.empty()) continue;
+            vector<const u64*> rows;
+            for(size_t i : live) rows.push_back(batch[i].alpha.data());
+            vector<u64> inner(rows.size());
+            params::batch_inner_products<Params>(share->SDi_packed.data(), share->SDi_packed.size(),
+                                                 rows.data(), rows.size(), inner.data());
+
+            for(size_t k = 0; k < live.size(); k++){
+                PendingVerification &item = batch[live[k]];
+                SessionContext sctx = make_session_context(item.session2);
+                u64 beta_di = params::beta_from_inner<Params>(inner[k], sctx);
+
+                g_response_cache.put(item.digest, beta_di);
+                if(item.deadline.expired()) reply_deadline_exceeded(item.out);
+                else reply_beta(item.out, beta_di);
+                for(const auto &waiter : take_waiters(item)) reply_beta(waiter, beta_di);
+            }
+        }
+
+        cout<<"[Device "<<state_.device_id<<"] Verified batch of "<<batch.size()
+            <<" request(s) across "<<groups.size()<<" user(s), window "<<window_us_<<" us\n";
+        adapt(batch.size());
+    }
+
+    void adapt(size_t batch_size){
+        if(batch_size > 1) window_us_ = min(max_window_us_, max(2 * window_us_, 25L));
+        else window_us_ = window_us_ < 50 ? 0 : window_us_ / 2;
+    }
+
+    // 取出并注销挂在该请求上的重复请求
+    vector<rpc::Responder> take_waiters(const PendingVerification &item){
+        auto it = inflight_.find(item.digest);
+        if(it == inflight_.end()) return {};
+        vector<rpc::Responder> waiters = move(it->second);
+        inflight_.erase(it);
+        return waiters;
+    }
+
+    void reply_error(PendingVerification &item, const string &error){
+        string line = net::JsonWriter().field("kind", "verification_response").field("error", error).finish();
+        item.out.reply(line);
+        for(const auto &waiter : take_waiters(item)) waiter.reply(line);
+    }
+
+    boost::asio::io_context &io_;
+    boost::asio::steady_timer timer_;
+    DeviceState &state_;
+    size_t batch_max_;
+    long max_window_us_;
+    long window_us_{0};
+    bool scheduled_{false};
+    vector<PendingVerification> pending_;
+    map<replay::ResponseCache::Digest, vector<rpc::Responder>> inflight_;
+};
+
+
+// 重放过滤器：同一用户在窗口内重复使用session2、而内容与已见过的请求不同的验证请求直接拒绝。
+// 不按请求方区分：请求方字段由客户端自填，既能绕过检查，也能让一方抢先占用另一方的session2。
+// 内容（verification_digest）相同的请求不算重放：服务器为同一session2转发的正是用户已直接发来的请求，
+// 应答缓存关闭、已淘汰或过期时它也须照常计算
+static replay::ReplayFilter g_replay;
+
+static bool first_seen(const string &user_id, const string &session2, const replay::ResponseCache::Digest &digest){
+    return g_replay.check_and_insert(user_id + "|" + session2, string_view((const char*)digest.data(), digest.size()));
+}
+
+static void reply_replayed(const rpc::Responder &out){
+    out.reply(net::JsonWriter().field("kind", "verification_response").field("error", "replayed").finish());
+}
+
+// 验证请求的快速路径：用JsonCursor直接把alpha解码进打包数组，不构建ptree。
+// 只接受形状完整、用户已注册且未撤销、alpha长度与n_vector一致的请求；
+// 其余情况返回false，由通用路径按原有逻辑解析并回复相应错误
+static bool try_fast_verification(DeviceState &state, VerificationBatcher &batcher,
+                                  const shared_ptr<rpc::ServerConnection> &conn, const string &line){
+    net::JsonCursor cur(line);
+    if(!cur.begin_object()) return false;
+
+    PendingVerification item;
+    item.user_id = "default";
+    bool have_user = false, have_rid = false, have_kind = false, have_session2 = false, have_alpha = false, have_deadline = false, have_epoch = false;
+    long deadline_ms = 0, share_epoch = 0;
+    string_view key;
+    while(cur.next_key(key)){
+        if(key == "kind" && !have_kind){
+            string kind;
+            if(!cur.read_string(kind) || kind != "verification_request") return false;
+            have_kind = true;
+        } else if(key == "user" && !have_user){
+            if(!cur.read_string(item.user_id)) return false;
+            have_user = true;
+        } else if(key == "rid" && !have_rid){
+            if(!cur.read_string(item.out.rid)) return false;
+            have_rid = true;
+        } else if(key == "session2" && !have_session2){
+            if(!cur.read_string(item.session2)) return false;
+            have_session2 = true;
+        } else if(key == "deadline_ms" && !have_deadline){
+            if(!cur.read_long(deadline_ms)) return false;
+            have_deadline = true;
+        } else if(key == "share_epoch" && !have_epoch){
+            if(!cur.read_long(share_epoch) || share_epoch < 0) return false;
+            have_epoch = true;
+        } else if(key == "alpha" && !have_alpha){
+            if(!cur.read_index_array(item.alpha)) return false;
+            have_alpha = true;
+        } else if(!cur.skip_value()){
+            return false;
+        }
+    }
+    if(!cur.closed() || !cur.at_end() || !have_kind || !have_session2 || !have_alpha) return false;
+
+    DeviceUserState *user = state.find_user(item.user_id);
+    if(!user || item.alpha.size() != (size_t)user->n_vector) return false;
+    item.share_epoch = have_epoch ? (uint64_t)share_epoch : user->committed_epoch;
+    const ShareVersion *share = user->share_for(item.share_epoch);
+    if(!share || share->revoked) return false;
+
+    item.out.conn = conn;
+    item.deadline = have_deadline ? net::Deadline::after_ms(deadline_ms) : net::Deadline::none();
+    if(item.deadline.expired()){
+        reply_deadline_exceeded(item.out);
+        return true;
+    }
+    for(auto &a : item.alpha) a %= Params::q;
+    // 先查应答缓存和攒批中的请求：内容相同的重试直接得到同一个β，session2相同而内容不同会被重放过滤器拦下
+    item.digest = verification_digest(item.user_id, user->generation, item.share_epoch, item.session2, item.alpha);
+    if(auto beta = g_response_cache.get(item.digest)){
+        reply_beta(item.out, *beta);
+        return true;
+    }
+    if(batcher.attach(item.digest, item.out)) return true;
+    if(!first_seen(item.user_id, item.session2, item.digest)){
+        reply_replayed(item.out);
+        return true;
+    }
+    batcher.submit(move(item));
+    return true;
+}
+
+static void handle_request(DeviceState &state, VerificationBatcher &batcher,
+                           const rpc::Responder &out, const boost::property_tree::ptree &pt){
+    int device_id = state.device_id;
+    string kind = pt.get<string>("kind", "");
+    string user_id = pt.get<string>("user", "default");
+
+    // 注册时创建用户记录，其他请求只查找已有记录；status对未注册用户返回空状态
+    DeviceUserState *record = kind == "register_device" ? &state.users[user_id] : state.find_user(user_id);
+    static DeviceUserState empty_record;
+    if(!record && kind != "status"){
+        cerr<<"[Device "<<device_id<<"] Unknown user: "<<user_id<<"\n";
+        boost::property_tree::ptree reply;
+        reply.put("kind", "error");
+        reply.put("message", "unknown_user");
+        out.reply(net::ptree_to_json(reply));
+        return;
+    }
+    DeviceUserState &user = record ? *record : empty_record;
+
+    if(kind == "register_device"){
+        // 一：注册阶段 - 从User那里收到自己的秘密份额SDi
+        cout<<"\n=== [Device "<<device_id<<"] Registration Phase ===\n";
+
+        state.device_id = pt.get<int>("device_id");
+        user.n_vector = pt.get<int>("n_vector");
+        user.t = pt.get<int>("t");
+        user.last_session1 = "1";
+
+        // 接收SDi，作为份额epoch 0（服务器注册时同样从0开始）
+        ShareVersion initial;
+        auto sdi_pt = pt.get_child("SDi");
+        initial.SDi.SetLength(user.n_vector);
+        for(int i = 0; i < user.n_vector; i++){
+            unsigned long ul = sdi_pt.get<unsigned long>(to_string(i));
+            initial.SDi[i] = conv<ZZ_p>(ZZ(ul));
+        }
+        params::pack_vec(initial.SDi, initial.SDi_packed);
+        user.shares.clear();
+        user.shares[0] = move(initial);
+        user.committed_epoch = 0;
+        user.generation++;
+
+        cout<<"User: "<<user_id<<"\n";
+        cout<<"Received SDi: ";
+        for(int i = 0; i < user.n_vector; i++) cout<<rep(user.shares[0].SDi[i])<<" ";
+        cout<<"\n";
+
+        boost::property_tree::ptree reply;
+        reply.put("kind", "register_ack");
+        reply.put("ok", 1);
+        out.reply(net::ptree_to_json(reply));
+
+        cout<<"[Device "<<device_id<<"] Registration completed.\n";
+
+    } else if(kind == "verification_request"){
+        // 二：验证阶段 - 解析后交给攒批器，βDi = round_toL(<α, SDi> * H(session2), q, q1)
+        // 服务器转发的请求带share_epoch，使用与其Ss同一epoch的份额；不带时使用已提交的epoch
+        uint64_t share_epoch = pt.get<uint64_t>("share_epoch", user.committed_epoch);
+        const ShareVersion *share = user.share_for(share_epoch);
+        if(!share || share->revoked){
+            const char *error = share ? "device_revoked" : "stale_epoch";
+            cout<<"[Device "<<device_id<<"] Rejecting verification request for user "<<user_id<<" at share epoch "<<share_epoch<<": "<<error<<"\n";
             boost::property_tree::ptree reply;
             reply.put("kind", "verification_response");
-            reply.put("beta", conv<unsigned long>(rep(beta_di)));
-            net::write_line(sock, net::ptree_to_json(reply));
-            
-            cout<<"[Device "<<device_id<<"] Verification step completed.\n";
-            
-        } else if(kind == "key_update"){
-            // 三：密钥更新阶段
-            cout<<"\n=== [Device "<<device_id<<"] Key Update Phase ===\n";
-            
-            // 1. 接收密钥更新参数session1
-            string session1 = pt.get<string>("session1", "1");
-            cout<<"Received session1: "<<session1<<"\n";
-            
-            // 2. 检查是否被撤销
-            if(session1 == "1"){
-                cout<<"Device "<<device_id<<" is being revoked (session1 = 1)\n";
-                state.is_revoked = true;
-            } else {
-                cout<<"Device "<<device_id<<" is active, updating key\n";
-                state.is_revoked = false;
-            }
-            
+            reply.put("error", error);
+            out.reply(net::ptree_to_json(reply));
+            return;
+        }
+
+        PendingVerification item;
+        item.out = out;
+        item.user_id = user_id;
+        item.share_epoch = share_epoch;
+        item.session2 = pt.get<string>("session2");
+        item.deadline = net::Deadline::from_ptree(pt);
+        if(item.deadline.expired()){
+            reply_deadline_exceeded(out);
+            return;
+        }
+
+        auto alpha_pt = pt.get_child("alpha");
+        item.alpha.resize(user.n_vector);
+        for(int i = 0; i < user.n_vector; i++){
+            item.alpha[i] = alpha_pt.get<unsigned long>(to_string(i)) % Params::q;
+        }
+        item.digest = verification_digest(user_id, user.generation, share_epoch, item.session2, item.alpha);
+        if(auto beta = g_response_cache.get(item.digest)){
+            cout<<"[Device "<<device_id<<"] Retried verification request for user "<<user_id<<", answered from cache.\n";
+            reply_beta(out, *beta);
+            return;
+        }
+        if(batcher.attach(item.digest, out)){
+            cout<<"[Device "<<device_id<<"] Duplicate verification request for user "<<user_id<<", attached to the pending one.\n";
+            return;
+        }
+        if(!first_seen(user_id, item.session2, item.digest)){
+            cout<<"[Device "<<device_id<<"] Replayed session2 for user "<<user_id<<", rejecting verification request.\n";
+            reply_replayed(out);
+            return;
+        }
+        batcher.submit(move(item));
+
+    } else if(kind == "key_update"){
+        // 三：密钥更新阶段（准备）：由share_epoch-1的份额算出share_epoch的份额并暂存，
+        // 已提交的份额保持不变，直到服务器发布新epoch后提交
+        cout<<"\n=== [Device "<<device_id<<"] Key Update Phase ===\n";
+
+        // 1. 接收密钥更新参数session1与目标epoch
+        string session1 = pt.get<string>("session1", "1");
+        uint64_t target = pt.get<uint64_t>("share_epoch", user.committed_epoch + 1);
+        cout<<"User: "<<user_id<<"\n";
+        cout<<"Received session1: "<<session1<<" (share epoch "<<target<<")\n";
+
+        auto base = target > 0 ? user.shares.find(target - 1) : user.shares.end();
+        if(base == user.shares.end()){
+            cout<<"Device "<<device_id<<" has no share for epoch "<<target - 1<<", rejecting key update\n";
+            boost::property_tree::ptree reply;
+            reply.put("kind", "key_update_ack");
+            reply.put("ok", 0);
+            reply.put("error", "stale_epoch");
+            out.reply(net::ptree_to_json(reply));
+            return;
+        }
+
+        // 2. 检查是否被撤销；已撤销的设备保持撤销
+        ShareVersion staged;
+        staged.revoked = session1 == "1" || base->second.revoked;
+        if(staged.revoked){
+            cout<<"Device "<<device_id<<" is being revoked (session1 = 1)\n";
+        } else {
             // 3. 设备自身完成密钥更新操作：SDi' = SDi * session1
+            cout<<"Device "<<device_id<<" is active, updating key\n";
             ZZ_p session1_elem = hash_to_ZZp_single(session1);
-            for(int i = 0; i < state.n_vector; i++){
-                state.SDi[i] *= session1_elem;
+            staged.SDi = base->second.SDi;
+            for(int i = 0; i < user.n_vector; i++){
+                staged.SDi[i] *= session1_elem;
             }
-            state.last_session1 = session1;
-            
+            params::pack_vec(staged.SDi, staged.SDi_packed);
+        }
+
+        // 重复的准备（上一次撤销中途放弃）覆盖旧的暂存份额；提前提交过的epoch退回到基础epoch
+        user.shares.erase(user.shares.upper_bound(target - 1), user.shares.end());
+        user.shares[target] = move(staged);
+        if(user.committed_epoch >= target) user.committed_epoch = target - 1;
+        user.last_session1 = session1;
+        const ShareVersion &updated = user.shares[target];
+
+        if(!updated.revoked){
             cout<<"Updated SDi': ";
-            for(int i = 0; i < state.n_vector; i++) cout<<rep(state.SDi[i])<<" ";
+            for(int i = 0; i < user.n_vector; i++) cout<<rep(updated.SDi[i])<<" ";
             cout<<"\n";
-            
-            boost::property_tree::ptree reply;
-            reply.put("kind", "key_update_ack");
-            reply.put("ok", 1);
-            reply.put("is_revoked", state.is_revoked);
-            
-            // 4. 如果未被撤销，发送更新后的密钥份额给Server（通过User请求）
-            if(!state.is_revoked){
-                boost::property_tree::ptree sdi_updated_pt;
-                for(int i = 0; i < state.n_vector; i++){
-                    sdi_updated_pt.put(to_string(i), conv<unsigned long>(rep(state.SDi[i])));
-                }
-                reply.add_child("SDi_updated", sdi_updated_pt);
-            }
-            
-            net::write_line(sock, net::ptree_to_json(reply));
-            
-            cout<<"[Device "<<device_id<<"] Key update completed.\n";
-            
-        } else if(kind == "send_updated_share"){
-            // 响应服务器请求，发送更新后的份额
-            cout<<"\n=== [Device "<<device_id<<"] Sending Updated Share ===\n";
-            
-            if(state.is_revoked){
-                boost::property_tree::ptree reply;
-                reply.put("kind", "share_response");
-                reply.put("error", "device_revoked");
-                net::write_line(sock, net::ptree_to_json(reply));
-                continue;
+        }
+
+        boost::property_tree::ptree reply;
+        reply.put("kind", "key_update_ack");
+        reply.put("ok", 1);
+        reply.put("is_revoked", updated.revoked);
+
+        // 4. 如果未被撤销，发送更新后的密钥份额给Server（通过User请求）
+        if(!updated.revoked){
+            boost::property_tree::ptree sdi_updated_pt;
+            for(int i = 0; i < user.n_vector; i++){
+                sdi_updated_pt.put(to_string(i), conv<unsigned long>(rep(updated.SDi[i])));
             }
-            
+            reply.add_child("SDi_updated", sdi_updated_pt);
+        }
+
+        out.reply(net::ptree_to_json(reply));
+
+        cout<<"[Device "<<device_id<<"] Key update staged for share epoch "<<target<<".\n";
+
+    } else if(kind == "key_commit" || kind == "key_abort"){
+        // 服务器发布新epoch后提交暂存的份额；撤销中途放弃时丢弃暂存的份额。两者都可重复发送
+        uint64_t epoch = pt.get<uint64_t>("share_epoch");
+        bool commit = kind == "key_commit";
+        if(commit) user.commit(epoch);
+        else if(epoch > user.committed_epoch) user.shares.erase(epoch);
+        cout<<"[Device "<<device_id<<"] "<<(commit ? "Committed" : "Aborted")<<" share epoch "<<epoch
+            <<" for user "<<user_id<<" (committed epoch "<<user.committed_epoch<<")\n";
+
+        boost::property_tree::ptree reply;
+        reply.put("kind", commit ? "key_commit_ack" : "key_abort_ack");
+        reply.put("ok", commit ? (int)(user.committed_epoch >= epoch) : 1);
+        reply.put("share_epoch", user.committed_epoch);
+        out.reply(net::ptree_to_json(reply));
+
+    } else if(kind == "send_updated_share"){
+        // 响应服务器请求，发送更新后的份额（缺省为最新暂存的epoch）
+        cout<<"\n=== [Device "<<device_id<<"] Sending Updated Share ===\n";
+
+        uint64_t epoch = pt.get<uint64_t>("share_epoch", user.shares.empty() ? 0 : user.shares.rbegin()->first);
+        auto it = user.shares.find(epoch);
+        if(it == user.shares.end() || it->second.revoked){
             boost::property_tree::ptree reply;
             reply.put("kind", "share_response");
-            reply.put("device_id", state.device_id);
-            
-            boost::property_tree::ptree sdi_pt;
-            for(int i = 0; i < state.n_vector; i++){
-                sdi_pt.put(to_string(i), conv<unsigned long>(rep(state.SDi[i])));
-            }
-            reply.add_child("SDi_updated", sdi_pt);
-            
-            net::write_line(sock, net::ptree_to_json(reply));
-            
-            cout<<"[Device "<<device_id<<"] Updated share sent to server.\n";
-            
-        } else if(kind == "status"){
-            // 状态查询
-            boost::property_tree::ptree reply;
-            reply.put("kind", "status_response");
-            reply.put("device_id", state.device_id);
-            reply.put("is_revoked", state.is_revoked);
-            reply.put("last_session1", state.last_session1);
-            net::write_line(sock, net::ptree_to_json(reply));
-            
-        } else {
-            cerr<<"[Device "<<device_id<<"] Unknown request kind: "<<kind<<"\n";
-            boost::property_tree::ptree reply;
-            reply.put("kind", "error");
-            reply.put("message", "unknown_request");
-            net::write_line(sock, net::ptree_to_json(reply));
+            reply.put("error", it == user.shares.end() ? "stale_epoch" : "device_revoked");
+            out.reply(net::ptree_to_json(reply));
+            return;
         }
+
+        boost::property_tree::ptree reply;
+        reply.put("kind", "share_response");
+        reply.put("device_id", state.device_id);
+        reply.put("share_epoch", epoch);
+
+        boost::property_tree::ptree sdi_pt;
+        for(int i = 0; i < user.n_vector; i++){
+            sdi_pt.put(to_string(i), conv<unsigned long>(rep(it->second.SDi[i])));
+        }
+        reply.add_child("SDi_updated", sdi_pt);
+
+        out.reply(net::ptree_to_json(reply));
+
+        cout<<"[Device "<<device_id<<"] Updated share sent to server.\n";
+
+    } else if(kind == "status"){
+        // 状态查询
+        boost::property_tree::ptree reply;
+        reply.put("kind", "status_response");
+        reply.put("device_id", state.device_id);
+        reply.put("is_revoked", user.is_revoked());
+        reply.put("share_epoch", user.committed_epoch);
+        reply.put("last_session1", user.last_session1);
+        out.reply(net::ptree_to_json(reply));
+
+    } else {
+        cerr<<"[Device "<<device_id<<"] Unknown request kind: "<<kind<<"\n";
+        boost::property_tree::ptree reply;
+        reply.put("kind", "error");
+        reply.put("message", "unknown_request");
+        out.reply(net::ptree_to_json(reply));
     }
+}
+
+static void do_accept(tcp::acceptor &acceptor, const rpc::ServerConnection::Handler &handler){
+    acceptor.async_accept([&acceptor, &handler](const boost::system::error_code &ec, tcp::socket sock){
+        if(!ec) make_shared<rpc::ServerConnection>(move(sock), handler)->start();
+        do_accept(acceptor, handler);
+    });
+}
+
+int main(int argc, char* argv[]){
+    if(argc < 2){ cerr<<"Usage: device_main <device_id>\n"; return 1; }
+    int device_id = atoi(argv[1]);
+
+    // 初始化网络配置
+    init_config("network.conf");
+    net::default_timeouts() = {g_config.connect_timeout_ms, g_config.read_timeout_ms, g_config.write_timeout_ms,
+                              g_config.idle_timeout_ms};  // 所有网络调用的默认超时
+    cout<<"[Device "<<device_id<<"] 配置的监听端口: "<<g_config.get_device_port(device_id)<<"\n";
+
+    // 每个验证请求记两个键（user|session2与带内容摘要的键）
+    g_replay.configure(g_config.replay_window_ms, 2 * (size_t)max(1, g_config.replay_capacity));
+    g_response_cache.configure((size_t)max(0, g_config.device_cache_size), g_config.device_cache_ttl_ms);
     
+    crypto_runtime::default_domain().install();
+    cout<<"[Device "<<device_id<<"] Starting device server (network backend: "<<net::backend_name()<<")\n";
+    cout<<"[Device "<<device_id<<"] Verification batching: max "<<g_config.device_batch_max
+        <<" requests, window up to "<<g_config.device_batch_window_us<<" us\n";
+    if(g_replay.enabled()){
+        cout<<"[Device "<<device_id<<"] Replay filter: window "<<g_config.replay_window_ms<<" ms, "<<g_replay.memory_bytes() / 1024<<" KiB\n";
+    }
+    if(g_response_cache.enabled()){
+        cout<<"[Device "<<device_id<<"] Response cache: "<<g_config.device_cache_size<<" entries, ttl "<<g_config.device_cache_ttl_ms<<" ms\n";
+    }
+
+    // 单线程事件循环：所有状态只在io.run()所在的主线程上访问
+    boost::asio::io_context io;
+    tcp::acceptor acceptor(io, tcp::endpoint(tcp::v4(), g_config.get_device_port(device_id)));
+
+    DeviceState state;
+    state.device_id = device_id;
+    VerificationBatcher batcher(io, state, (size_t)g_config.device_batch_max, g_config.device_batch_window_us);
+
+    rpc::ServerConnection::Handler handler = [&](const shared_ptr<rpc::ServerConnection> &conn, const string &line){
+        try {
+            if(try_fast_verification(state, batcher, conn, line)) return;
+            auto pt = net::json_to_ptree(line);
+            handle_request(state, batcher, rpc::Responder{conn, pt.get<string>("rid", "")}, pt);
+        } catch(const exception &e){
+            cerr<<"[Device "<<device_id<<"] Malformed request: "<<e.what()<<"\n";
+            boost::property_tree::ptree reply;
+            reply.put("kind", "error");
+            reply.put("message", "malformed_request");
+            rpc::Responder{conn, rpc::peek_rid(line)}.reply(net::ptree_to_json(reply));
+        }
+    };
+    do_accept(acceptor, handler);
+    io.run();
+
     return 0;
-} 
+}
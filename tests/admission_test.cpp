@@ -0,0 +1,205 @@
+// 准入控制：请求分类、队列满时拒绝、按优先级出队、每类的并发上限
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "common/admission.hpp"
+#include "tests/check.hpp"
+
+using admission::Priority;
+
+// 等待计数归零；只用于测试中等待提交的任务全部结束
+class Latch {
+public:
+    explicit Latch(int n) : n_(n) {}
+    void count_down(){
+        std::lock_guard<std::mutex> lk(mu_);
+        if(--n_ == 0) cv_.notify_all();
+    }
+    bool wait(int timeout_ms = 5000){
+        std::unique_lock<std::mutex> lk(mu_);
+        return cv_.wait_for(lk, std::chrono::milliseconds(timeout_ms), [this]{ return n_ <= 0; });
+    }
+private:
+    std::mutex mu_;
+    std::condition_variable cv_;
+    int n_;
+};
+
+static void classify_and_config(){
+    CHECK(admission::classify("verification_request") == Priority::INTERACTIVE);
+    CHECK(admission::classify("server_verification") == Priority::INTERACTIVE);
+    CHECK(admission::classify("key_agreement") == Priority::INTERACTIVE);
+    CHECK(admission::classify("store_cipher") == Priority::WRITE);
+    CHECK(admission::classify("migrate_user") == Priority::WRITE);
+    CHECK(admission::classify("revoke_devices") == Priority::BULK);
+    CHECK(admission::classify("batch_verification_request") == Priority::BULK);
+    CHECK(admission::classify("status") == Priority::BACKGROUND);
+    CHECK(admission::classify("no_such_kind") == Priority::BACKGROUND);
+
+    for(size_t i = 0; i < admission::PRIORITY_COUNT; i++){
+        Priority p;
+        CHECK(admission::parse_priority(admission::to_string((Priority)i), p));
+        CHECK(p == (Priority)i);
+    }
+    Priority p = Priority::WRITE;
+    CHECK(!admission::parse_priority("urgent", p));
+    CHECK(p == Priority::WRITE);
+
+    auto l = admission::default_limits();
+    CHECK_EQ(l[(size_t)Priority::INTERACTIVE].max_running, 0);
+    CHECK_EQ(l[(size_t)Priority::BULK].max_running, 1);
+    CHECK_EQ(l[(size_t)Priority::BACKGROUND].max_running, 1);
+}
+
+static void full_queue_rejects(){
+    crypto_runtime::ModulusDomain domain(2147483647);
+    crypto_runtime::WorkerPool pool(domain, 1);
+    admission::Limits limits = admission::default_limits();
+    limits[(size_t)Priority::BULK] = {1, 2};
+    admission::Scheduler sched(pool, limits);
+
+    // 占住唯一的工作线程，之后提交的请求都只能排队
+    std::mutex gate_mu;
+    std::condition_variable gate_cv;
+    bool started = false, release = false;
+    CHECK(sched.try_submit(Priority::INTERACTIVE, [&]{
+        std::unique_lock<std::mutex> lk(gate_mu);
+        started = true;
+        gate_cv.notify_all();
+        gate_cv.wait(lk, [&]{ return release; });
+    }));
+    {
+        std::unique_lock<std::mutex> lk(gate_mu);
+        gate_cv.wait(lk, [&]{ return started; });
+    }
+
+    std::atomic<int> ran{0};
+    Latch done(3);
+    CHECK(sched.try_submit(Priority::BULK, [&]{ ran++; done.count_down(); }));
+    CHECK(sched.try_submit(Priority::BULK, [&]{ ran++; done.count_down(); }));
+    CHECK(!sched.try_submit(Priority::BULK, [&]{ ran += 100; }));
+    CHECK(!sched.try_submit(Priority::BULK, [&]{ ran += 100; }));
+    CHECK_EQ(sched.rejected(Priority::BULK), 2u);
+    // 其他类别的队列不受影响
+    CHECK(sched.try_submit(Priority::INTERACTIVE, [&]{ ran++; done.count_down(); }));
+    CHECK_EQ(sched.rejected(Priority::INTERACTIVE), 0u);
+
+    {
+        std::lock_guard<std::mutex> lk(gate_mu);
+        release = true;
+    }
+    gate_cv.notify_all();
+    CHECK(done.wait());
+    CHECK_EQ(ran.load(), 3);
+}
+
+static void higher_priority_runs_first(){
+    crypto_runtime::ModulusDomain domain(2147483647);
+    crypto_runtime::WorkerPool pool(domain, 1);
+    admission::Scheduler sched(pool, admission::default_limits());
+
+    std::mutex gate_mu;
+    std::condition_variable gate_cv;
+    bool started = false, release = false;
+    sched.try_submit(Priority::BACKGROUND, [&]{
+        std::unique_lock<std::mutex> lk(gate_mu);
+        started = true;
+        gate_cv.notify_all();
+        gate_cv.wait(lk, [&]{ return release; });
+    });
+    {
+        std::unique_lock<std::mutex> lk(gate_mu);
+        gate_cv.wait(lk, [&]{ return started; });
+    }
+
+    // 按优先级从低到高提交，出队顺序应相反；同一类别内先进先出
+    std::mutex order_mu;
+    std::vector<std::string> order;
+    Latch done(5);
+    auto record = [&](std::string name){
+        return [&, name]{
+            {
+                std::lock_guard<std::mutex> lk(order_mu);
+                order.push_back(name);
+            }
+            done.count_down();
+        };
+    };
+    sched.try_submit(Priority::BACKGROUND, record("background"));
+    sched.try_submit(Priority::BULK, record("bulk"));
+    sched.try_submit(Priority::WRITE, record("write"));
+    sched.try_submit(Priority::INTERACTIVE, record("interactive1"));
+    sched.try_submit(Priority::INTERACTIVE, record("interactive2"));
+
+    {
+        std::lock_guard<std::mutex> lk(gate_mu);
+        release = true;
+    }
+    gate_cv.notify_all();
+    CHECK(done.wait());
+    CHECK(order == (std::vector<std::string>{"interactive1", "interactive2", "write", "bulk", "background"}));
+}
+
+static void max_running_caps_class(){
+    crypto_runtime::ModulusDomain domain(2147483647);
+    crypto_runtime::WorkerPool pool(domain, 4);
+    admission::Scheduler sched(pool, admission::default_limits());
+
+    // BULK最多同时占用一个工作线程：第一个批量请求阻塞期间，第二个不能开始，交互式请求照常执行
+    std::mutex gate_mu;
+    std::condition_variable gate_cv;
+    bool started = false, release = false;
+    std::atomic<int> bulk_running{0}, bulk_peak{0};
+    Latch bulk_done(3);
+    auto bulk = [&](bool block){
+        return [&, block]{
+            int now = ++bulk_running;
+            int peak = bulk_peak.load();
+            while(now > peak && !bulk_peak.compare_exchange_weak(peak, now)){}
+            if(block){
+                std::unique_lock<std::mutex> lk(gate_mu);
+                started = true;
+                gate_cv.notify_all();
+                gate_cv.wait(lk, [&]{ return release; });
+            }
+            bulk_running--;
+            bulk_done.count_down();
+        };
+    };
+    CHECK(sched.try_submit(Priority::BULK, bulk(true)));
+    {
+        std::unique_lock<std::mutex> lk(gate_mu);
+        gate_cv.wait(lk, [&]{ return started; });
+    }
+    CHECK(sched.try_submit(Priority::BULK, bulk(false)));
+    CHECK(sched.try_submit(Priority::BULK, bulk(false)));
+
+    const int INTERACTIVE = 12;
+    Latch interactive_done(INTERACTIVE);
+    for(int i = 0; i < INTERACTIVE; i++){
+        CHECK(sched.try_submit(Priority::INTERACTIVE, [&]{ interactive_done.count_down(); }));
+    }
+    CHECK(interactive_done.wait());
+    CHECK_EQ(bulk_running.load(), 1);
+
+    {
+        std::lock_guard<std::mutex> lk(gate_mu);
+        release = true;
+    }
+    gate_cv.notify_all();
+    CHECK(bulk_done.wait());
+    CHECK_EQ(bulk_peak.load(), 1);
+}
+
+int main(){
+    classify_and_config();
+    full_queue_rejects();
+    higher_priority_runs_first();
+    max_running_caps_class();
+    if(test::failures() == 0) std::cout << "admission_test: all checks passed" << std::endl;
+    return test::failures() == 0 ? 0 : 1;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <iostream>
+
+// 最小的测试断言：失败时打印位置与表达式并计数，main返回失败数供ctest判断
+namespace test {
+    inline int& failures(){
+        static int n = 0;
+        return n;
+    }
+}
+
+#define CHECK(cond) do { \
+    if(!(cond)){ \
+        std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed" << std::endl; \
+        test::failures()++; \
+    } \
+} while(0)
+
+#define CHECK_EQ(a, b) do { \
+    auto &&check_a_ = (a); auto &&check_b_ = (b); \
+    if(!(check_a_ == check_b_)){ \
+        std::cerr << __FILE__ << ":" << __LINE__ << ": CHECK_EQ(" #a ", " #b ") failed: " \
+                  << check_a_ << " != " << check_b_ << std::endl; \
+        test::failures()++; \
+    } \
+} while(0)
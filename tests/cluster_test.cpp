@@ -0,0 +1,166 @@
+// 一致性哈希环与集群端点表：归属须在各进程间确定一致，增删节点时只有受影响的用户改变归属，
+// 迁移（rebalance_users）依赖这一点只搬动新旧归属不同的用户
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+#include "common/cluster.hpp"
+#include "common/config.hpp"
+#include "common/endpoints.hpp"
+#include "tests/check.hpp"
+
+static std::vector<std::string> users(int n){
+    std::vector<std::string> v;
+    for(int i = 0; i < n; i++) v.push_back("user" + std::to_string(i));
+    return v;
+}
+
+static void ring_is_deterministic(){
+    cluster::HashRing a, b;
+    CHECK_EQ(a.owner("alice"), -1);
+    CHECK_EQ(a.size(), 0u);
+    // 加入顺序不影响归属
+    for(int n : {1, 2, 3}) a.add(n);
+    for(int n : {3, 1, 2}) b.add(n);
+    b.add(2);   // 重复加入不改变环
+    CHECK_EQ(b.size(), 3u);
+    CHECK(a.nodes() == (std::vector<int>{1, 2, 3}));
+    std::map<int, int> load;
+    for(const auto &u : users(3000)){
+        CHECK_EQ(a.owner(u), b.owner(u));
+        load[a.owner(u)]++;
+    }
+    // 64个虚拟节点下每个节点都分到相当一部分用户
+    CHECK_EQ(load.size(), 3u);
+    for(const auto &kv : load) CHECK(kv.second > 500);
+    CHECK_EQ(cluster::hash64("alice"), cluster::hash64(std::string("alice")));
+}
+
+static void adding_node_moves_keys_only_to_it(){
+    cluster::HashRing before, after;
+    for(int n : {1, 2, 3}){ before.add(n); after.add(n); }
+    after.add(4);
+    int moved = 0;
+    for(const auto &u : users(3000)){
+        int old_owner = before.owner(u), new_owner = after.owner(u);
+        if(old_owner != new_owner){
+            CHECK_EQ(new_owner, 4);
+            moved++;
+        }
+    }
+    CHECK(moved > 0);
+    CHECK(moved < 1500);
+
+    // 删除节点后归属恢复原样，只有原属该节点的用户移走
+    after.remove(4);
+    after.remove(4);
+    CHECK(!after.contains(4));
+    for(const auto &u : users(3000)) CHECK_EQ(after.owner(u), before.owner(u));
+
+    cluster::HashRing shrunk;
+    for(int n : {1, 2, 3}) shrunk.add(n);
+    shrunk.remove(2);
+    for(const auto &u : users(3000)){
+        if(before.owner(u) != 2) CHECK_EQ(shrunk.owner(u), before.owner(u));
+        else CHECK(shrunk.owner(u) == 1 || shrunk.owner(u) == 3);
+    }
+    shrunk.remove(1);
+    shrunk.remove(3);
+    CHECK_EQ(shrunk.owner("alice"), -1);
+}
+
+static void tags_partition_independently(){
+    // 集群节点与同机分片用不同tag，两级划分互不相关
+    cluster::HashRing node(cluster::HashRing::DEFAULT_VNODES, "node");
+    cluster::HashRing shard(cluster::HashRing::DEFAULT_VNODES, "shard");
+    for(int n : {0, 1, 2, 3}){ node.add(n); shard.add(n); }
+    int same = 0;
+    for(const auto &u : users(2000)) if(node.owner(u) == shard.owner(u)) same++;
+    CHECK(same < 1000);
+}
+
+static NetworkConfig cluster_config(){
+    NetworkConfig cfg;
+    cfg.server_ip = "127.0.0.1";
+    cfg.server_port = 9000;
+    cfg.server_node_ips = {{1, "127.0.0.1"}, {2, "127.0.0.2"}, {3, "bad address"}};
+    cfg.server_node_ports = {{1, 9001}, {2, 9002}, {3, 9003}};
+    cfg.device_ips = {{1, "10.0.0.1"}, {2, "10.0.0.2"}};
+    cfg.device_ports = {{1, 9101}, {2, 9102}};
+    cfg.server_zone = "z1";
+    cfg.server_rack = "r1";
+    cfg.device_zones = {{1, "z1"}, {2, "z2"}};
+    cfg.device_racks = {{1, "r1"}};
+    return cfg;
+}
+
+static void endpoint_table_routes_by_owner(){
+    NetworkConfig cfg = cluster_config();
+    auto table = endpoints::EndpointTable::build(cfg, 7);
+    CHECK_EQ(table->version(), 7u);
+    CHECK(table->clustered());
+    // 地址无法解析的节点不进入环
+    CHECK(table->has_server_node(1));
+    CHECK(table->has_server_node(2));
+    CHECK(!table->has_server_node(3));
+
+    cluster::HashRing ring;
+    ring.add(1);
+    ring.add(2);
+    for(const auto &u : users(500)){
+        int owner = table->owner_node(u);
+        CHECK_EQ(owner, ring.owner(u));
+        CHECK(table->server_for(u) == table->server_node(owner));
+        CHECK_EQ(table->server_for(u).port(), owner == 1 ? 9001 : 9002);
+    }
+
+    CHECK_EQ(table->device(1).port(), 9101);
+    CHECK_EQ(table->device(1).address().to_string(), "10.0.0.1");
+    CHECK_EQ(table->tier(1), endpoints::EndpointTable::TIER_SAME_RACK);
+    CHECK_EQ(table->tier(2), endpoints::EndpointTable::TIER_REMOTE);
+    CHECK_EQ(table->tier(99), endpoints::EndpointTable::TIER_REMOTE);
+
+    // 没有配置服务器节点时所有用户都去SERVER_IP
+    NetworkConfig single = cluster_config();
+    single.server_node_ips.clear();
+    single.server_node_ports.clear();
+    auto plain = endpoints::EndpointTable::build(single, 1);
+    CHECK(!plain->clustered());
+    CHECK_EQ(plain->owner_node("alice"), -1);
+    CHECK(plain->server_for("alice") == plain->server());
+    CHECK_EQ(plain->server().port(), 9000);
+}
+
+static void publish_swaps_snapshot(){
+    NetworkConfig cfg = cluster_config();
+    endpoints::init(cfg);
+    auto held = endpoints::current();
+    CHECK_EQ(held->version(), 1u);
+    cfg.server_node_ports[2] = 9202;
+    endpoints::publish(endpoints::EndpointTable::build(cfg, 2));
+    // 已取得的快照不受新表影响，也不会被释放
+    CHECK_EQ(held->version(), 1u);
+    CHECK_EQ(held->server_node(2).port(), 9002);
+    CHECK_EQ(endpoints::current()->version(), 2u);
+    CHECK_EQ(endpoints::current()->server_node(2).port(), 9202);
+    // 被替换的表在最后一个快照释放时随之释放
+    std::weak_ptr<const endpoints::EndpointTable> old = held;
+    held.reset();
+    CHECK(old.expired());
+    auto second = endpoints::current();
+    std::weak_ptr<const endpoints::EndpointTable> replaced = second;
+    endpoints::publish(endpoints::EndpointTable::build(cfg, 3));
+    CHECK(!replaced.expired());
+    second.reset();
+    CHECK(replaced.expired());
+}
+
+int main(){
+    ring_is_deterministic();
+    adding_node_moves_keys_only_to_it();
+    tags_partition_independently();
+    endpoint_table_routes_by_owner();
+    publish_swaps_snapshot();
+    if(test::failures() == 0) std::cout << "cluster_test: all checks passed" << std::endl;
+    return test::failures() == 0 ? 0 : 1;
+}
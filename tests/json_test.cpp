@@ -0,0 +1,218 @@
+// JsonWriter/JsonCursor与rpc的消息改写须与ptree的read_json/write_json保持一致：
+// 快速路径与回退路径对同一条消息看到的字段、写出的字节都不能不同
+#include <boost/property_tree/ptree.hpp>
+#include <string>
+#include <vector>
+#include "common/net.hpp"
+#include "common/rpc.hpp"
+#include "tests/check.hpp"
+
+using boost::property_tree::ptree;
+
+// 转义规则覆盖到的字符：控制字符、引号、反斜杠、'/'、DEL、UTF-8多字节序列
+static const std::vector<std::string> SAMPLES = {
+    "",
+    "plain",
+    "quote\" backslash\\ slash/",
+    "\b\f\n\r\t",
+    std::string("nul\0byte", 8),
+    "\x01\x1f\x7f",
+    "caf\xc3\xa9 \xe4\xb8\xad\xe6\x96\x87 \xf0\x9f\x98\x80",
+};
+
+static void writer_matches_write_json(){
+    for(const auto &s : SAMPLES){
+        ptree pt;
+        pt.put("kind", "status");
+        pt.put("k/ey", s);
+        pt.put("n", 42);
+        std::string w = net::JsonWriter().field("kind", "status").field("k/ey", s).field("n", 42).finish();
+        CHECK_EQ(w, net::ptree_to_json(pt));
+    }
+
+    ptree pt;
+    pt.put("ok", true);
+    pt.put("big", (uint64_t)18446744073709551615ULL);
+    ptree arr;
+    arr.put("0", 7);
+    arr.put("1", 2147483646);
+    pt.add_child("alpha", arr);
+    ptree nested;
+    nested.put("x", "y");
+    pt.add_child("obj", nested);
+    std::string w = net::JsonWriter()
+        .field("ok", true)
+        .field("big", (uint64_t)18446744073709551615ULL)
+        .index_array("alpha", std::vector<uint64_t>{7, 2147483646})
+        .begin_object("obj").field("x", "y").end_object()
+        .finish();
+    CHECK_EQ(w, net::ptree_to_json(pt));
+}
+
+static void cursor_reads_what_read_json_reads(){
+    for(const auto &s : SAMPLES){
+        std::string line = net::JsonWriter().field("v", s).finish();
+        net::JsonCursor cur(line);
+        std::string_view key;
+        std::string got;
+        CHECK(cur.begin_object());
+        CHECK(cur.next_key(key));
+        CHECK_EQ(key, "v");
+        CHECK(cur.read_string(got));
+        CHECK(!cur.next_key(key));
+        CHECK(cur.closed());
+        CHECK(cur.at_end());
+        CHECK_EQ(got, net::json_to_ptree(line).get<std::string>("v"));
+        CHECK_EQ(got, s);
+    }
+}
+
+static void unicode_escapes(){
+    // BMP内的\u转义与read_json解码结果相同
+    std::string line = "{\"v\":\"\\u0041\\u00e9\\u4e2d\\u0000x\\/\"}";
+    net::JsonCursor cur(line);
+    std::string_view key;
+    std::string got;
+    CHECK(cur.begin_object() && cur.next_key(key) && cur.read_string(got));
+    CHECK_EQ(got, net::json_to_ptree(line).get<std::string>("v"));
+    CHECK_EQ(got, std::string("A\xc3\xa9\xe4\xb8\xad\0x/", 9));
+
+    // 代理对不在快速路径上解码，交给ptree处理
+    std::string pair = "{\"v\":\"\\ud83d\\ude00\"}";
+    net::JsonCursor cur2(pair);
+    CHECK(cur2.begin_object() && cur2.next_key(key));
+    CHECK(!cur2.read_string(got));
+    CHECK(!cur2.ok());
+    CHECK_EQ(net::json_to_ptree(pair).get<std::string>("v"), "\xf0\x9f\x98\x80");
+
+    // 截断或非十六进制的转义
+    for(std::string bad : {"{\"v\":\"\\u00\"}", "{\"v\":\"\\u00zz\"}", "{\"v\":\"\\q\"}"}){
+        net::JsonCursor c(bad);
+        CHECK(c.begin_object() && c.next_key(key));
+        CHECK(!c.read_string(got));
+    }
+}
+
+static void quoted_and_bare_numbers(){
+    for(std::string line : {"{\"n\":\"123\"}", "{\"n\":123}", "{ \"n\" : 123 }"}){
+        net::JsonCursor cur(line);
+        std::string_view key;
+        long v = 0;
+        CHECK(cur.begin_object() && cur.next_key(key) && cur.read_long(v));
+        CHECK_EQ(v, 123);
+        CHECK(!cur.next_key(key) && cur.closed());
+        CHECK_EQ(v, net::json_to_ptree(line).get<long>("n"));
+    }
+    {
+        std::string line = "{\"n\":\"-5\"}";
+        net::JsonCursor cur(line);
+        std::string_view key;
+        long v = 0;
+        CHECK(cur.begin_object() && cur.next_key(key) && cur.read_long(v));
+        CHECK_EQ(v, -5);
+        net::JsonCursor cur2(line);
+        uint64_t u = 0;
+        CHECK(cur2.begin_object() && cur2.next_key(key));
+        CHECK(!cur2.read_u64(u));
+    }
+    for(std::string bad : {"{\"n\":\"12x\"}", "{\"n\":\"\"}", "{\"n\":abc}"}){
+        net::JsonCursor cur(bad);
+        std::string_view key;
+        long v = 0;
+        CHECK(cur.begin_object() && cur.next_key(key));
+        CHECK(!cur.read_long(v));
+    }
+    {
+        // 值本身完整但对象被截断
+        net::JsonCursor cur("{\"n\":\"12\"");
+        std::string_view key;
+        long v = 0;
+        CHECK(cur.begin_object() && cur.next_key(key) && cur.read_long(v));
+        CHECK(!cur.next_key(key) && !cur.closed() && !cur.ok());
+    }
+
+    // 数组：带引号与不带引号的元素都接受，键须为从0开始的连续下标
+    {
+        std::string line = "{\"alpha\":{\"0\":\"7\",\"1\":8,\"2\":\"2147483646\"}}";
+        net::JsonCursor cur(line);
+        std::string_view key;
+        std::vector<uint64_t> out;
+        CHECK(cur.begin_object() && cur.next_key(key) && cur.read_index_array(out));
+        CHECK(out == (std::vector<uint64_t>{7, 8, 2147483646}));
+        ptree pt = net::json_to_ptree(line);
+        CHECK_EQ(out.size(), pt.get_child("alpha").size());
+        for(size_t i = 0; i < out.size(); i++) CHECK_EQ(out[i], pt.get<uint64_t>("alpha." + std::to_string(i)));
+    }
+    for(std::string bad : {"{\"a\":{\"1\":\"7\"}}", "{\"a\":{\"0\":\"7\",\"0\":\"8\"}}", "{\"a\":{\"x\":\"7\"}}", "{\"a\":{\"0\":\"7\""}){
+        net::JsonCursor cur(bad);
+        std::string_view key;
+        std::vector<uint64_t> out;
+        CHECK(cur.begin_object() && cur.next_key(key));
+        CHECK(!cur.read_index_array(out));
+    }
+}
+
+static void tag_round_trip(){
+    std::string line = net::JsonWriter().field("kind", "status").field("user", "u/1").finish();
+    std::string tagged = rpc::tag(line, "r\"7");
+    CHECK_EQ(rpc::peek_rid(tagged), "r\"7");
+    ptree pt = net::json_to_ptree(tagged);
+    CHECK_EQ(pt.get<std::string>("rid"), "r\"7");
+    CHECK_EQ(pt.get<std::string>("user"), "u/1");
+    CHECK_EQ(rpc::tag(line, ""), line);
+    CHECK_EQ(rpc::peek_rid(line), "");
+    CHECK_EQ(rpc::peek_rid("not json"), "");
+
+    std::string empty = rpc::tag("{}\n", "9");
+    CHECK_EQ(empty, "{\"rid\":\"9\"}\n");
+    CHECK_EQ(rpc::peek_rid(empty), "9");
+}
+
+static void peek_and_untag(){
+    std::string line = "{\"kind\":\"status\",\"user\":\"alice\",\"rid\":\"1\"}\n";
+    std::string kind, user, rid;
+    CHECK(rpc::peek_fields(line, {{"kind", &kind}, {"user", &user}, {"rid", &rid}}));
+    CHECK_EQ(kind, "status");
+    CHECK_EQ(user, "alice");
+    CHECK_EQ(rid, "1");
+
+    // 缺失的字段保持原值，格式错误返回false
+    std::string missing = "keep";
+    CHECK(rpc::peek_fields("{\"kind\":\"status\"}", {{"user", &missing}}));
+    CHECK_EQ(missing, "keep");
+    CHECK(!rpc::peek_fields("{\"kind\":\"status\"", {{"kind", &kind}}));
+    CHECK(!rpc::peek_fields("[1]", {{"kind", &kind}}));
+
+    // tag之后untag还原原消息；rid在开头、中间或末尾
+    std::string plain = net::JsonWriter().field("kind", "status").field("user", "u/1").finish();
+    CHECK_EQ(rpc::untag(rpc::tag(plain, "r\"7")), plain);
+    CHECK_EQ(rpc::untag(plain), plain);
+    CHECK_EQ(rpc::untag("{\"a\":\"1\",\"rid\":\"x\",\"b\":\"2\"}\n"), "{\"a\":\"1\",\"b\":\"2\"}\n");
+    CHECK_EQ(rpc::untag("{\"a\":\"1\",\"rid\":\"x\"}\n"), "{\"a\":\"1\"}\n");
+    CHECK_EQ(rpc::untag("{\"rid\":\"x\"}\n"), "{}\n");
+    CHECK_EQ(rpc::untag(rpc::tag("{}\n", "9")), "{}\n");
+}
+
+static void duplicate_keys(){
+    // ptree的get取第一次出现的值，peek_fields须与之一致，否则按用户路由与处理看到的用户不同
+    std::string line = "{\"kind\":\"status\",\"user\":\"alice\",\"rid\":\"1\",\"user\":\"bob\",\"rid\":\"2\"}\n";
+    ptree pt = net::json_to_ptree(line);
+    std::string kind, user, rid;
+    CHECK(rpc::peek_fields(line, {{"kind", &kind}, {"user", &user}, {"rid", &rid}}));
+    CHECK_EQ(kind, "status");
+    CHECK_EQ(user, pt.get<std::string>("user"));
+    CHECK_EQ(rid, pt.get<std::string>("rid"));
+    CHECK_EQ(rpc::peek_rid(line), "1");
+}
+
+int main(){
+    writer_matches_write_json();
+    cursor_reads_what_read_json_reads();
+    unicode_escapes();
+    quoted_and_bare_numbers();
+    tag_round_trip();
+    peek_and_untag();
+    duplicate_keys();
+    if(test::failures() == 0) std::cout << "json_test: all checks passed" << std::endl;
+    return test::failures() == 0 ? 0 : 1;
+}
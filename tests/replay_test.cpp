@@ -0,0 +1,41 @@
+// 重放过滤器：窗口内重复的键被拒绝；带内容检查时同一内容的重复放行、不同内容才算重放
+#include <string>
+#include "common/replay.hpp"
+#include "tests/check.hpp"
+
+static void rejects_repeated_key(){
+    replay::ReplayFilter off;
+    CHECK(!off.enabled());
+    CHECK(off.check_and_insert("k"));
+    CHECK(off.check_and_insert("k"));
+
+    replay::ReplayFilter filter(60000, 1000);
+    CHECK(filter.enabled());
+    CHECK(filter.check_and_insert("verification_request|alice|s1"));
+    CHECK(!filter.check_and_insert("verification_request|alice|s1"));
+    CHECK(filter.check_and_insert("verification_request|bob|s1"));
+    CHECK(filter.check_and_insert("server_verification|alice|s1"));
+}
+
+static void same_content_is_not_a_replay(){
+    replay::ReplayFilter filter(60000, 1000);
+    // 用户直接发来的请求与服务器转发的同一请求内容相同，两次都放行
+    CHECK(filter.check_and_insert("alice|s1", "digest-a"));
+    CHECK(filter.check_and_insert("alice|s1", "digest-a"));
+    // 同一session2换了alpha或份额，是重放
+    CHECK(!filter.check_and_insert("alice|s1", "digest-b"));
+    CHECK(filter.check_and_insert("alice|s1", "digest-a"));
+    // 内容键不与其他用户或session2混淆
+    CHECK(filter.check_and_insert("alice|s2", "digest-b"));
+    CHECK(filter.check_and_insert("bob|s1", "digest-b"));
+    CHECK(!filter.check_and_insert("bob|s1", "digest-a"));
+    // 只按键检查时，带内容记下的键同样算见过
+    CHECK(!filter.check_and_insert("alice|s1"));
+}
+
+int main(){
+    rejects_repeated_key();
+    same_content_is_not_a_replay();
+    if(test::failures() == 0) std::cout << "replay_test: all checks passed" << std::endl;
+    return test::failures() == 0 ? 0 : 1;
+}
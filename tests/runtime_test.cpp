@@ -0,0 +1,60 @@
+// WorkerPool::parallel_for：覆盖全部区间、在工作线程上嵌套调用时串行执行、
+// 有区间抛异常时等其余区间都结束后才把异常交给调用方
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+#include "common/runtime.hpp"
+#include "tests/check.hpp"
+
+static void covers_every_index(){
+    crypto_runtime::ModulusDomain domain(2147483647);
+    crypto_runtime::WorkerPool pool(domain, 4);
+    std::vector<std::atomic<int>> hits(1000);
+    pool.parallel_for(hits.size(), [&](size_t b, size_t e){
+        for(size_t i = b; i < e; i++) hits[i]++;
+    });
+    for(auto &h : hits) CHECK_EQ(h.load(), 1);
+    pool.parallel_for(0, [&](size_t, size_t){ CHECK(false); });
+}
+
+static void nested_call_runs_inline(){
+    crypto_runtime::ModulusDomain domain(2147483647);
+    crypto_runtime::WorkerPool pool(domain, 2);
+    std::atomic<int> total{0};
+    // 每个工作线程都在嵌套调用里等待时，若嵌套调用再提交到池中就会死锁
+    pool.parallel_for(2, [&](size_t b, size_t e){
+        for(size_t i = b; i < e; i++){
+            pool.parallel_for(10, [&](size_t b2, size_t e2){ total += (int)(e2 - b2); });
+        }
+    });
+    CHECK_EQ(total.load(), 20);
+}
+
+static void exception_waits_for_other_ranges(){
+    crypto_runtime::ModulusDomain domain(2147483647);
+    crypto_runtime::WorkerPool pool(domain, 4);
+    std::atomic<int> finished{0};
+    bool threw = false;
+    try {
+        pool.parallel_for(4, [&](size_t b, size_t){
+            if(b == 0) throw std::runtime_error("range 0");
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            finished++;
+        });
+    } catch(const std::runtime_error &e){
+        threw = std::string(e.what()) == "range 0";
+        // 异常到达调用方时其余区间都已结束，不再引用调用方栈上的fn
+        CHECK_EQ(finished.load(), 3);
+    }
+    CHECK(threw);
+}
+
+int main(){
+    covers_every_index();
+    nested_call_runs_inline();
+    exception_waits_for_other_ranges();
+    if(test::failures() == 0) std::cout << "runtime_test: all checks passed" << std::endl;
+    return test::failures() == 0 ? 0 : 1;
+}
@@ -0,0 +1,98 @@
+// 验证设备的选择与rw恢复：t=2时份额可互换，按时延挑选并对冲；t>2时只能用设备1..t-1，
+// 时延、距离与可达性都不能改变这个集合，否则服务器恢复出的rw与两级PRF不一致
+#include <string>
+#include <vector>
+#include "common/crypto.hpp"
+#include "common/params.hpp"
+#include "common/runtime.hpp"
+#include "common/share.hpp"
+#include "tests/check.hpp"
+
+using Params = params::DefaultProfile;
+
+static const int N_VECTOR = 8;
+
+static vec_ZZ_p random_vector(){
+    vec_ZZ_p v;
+    v.SetLength(N_VECTOR);
+    for(int i = 0; i < N_VECTOR; i++) v[i] = random_ZZ_p();
+    return v;
+}
+
+static DeviceBitmap all_active(int n){
+    DeviceBitmap active(n);
+    for(int dev = 1; dev <= n; dev++) active.set(dev);
+    return active;
+}
+
+// 与server_verification相同的恢复过程：各设备与服务器按α计算β，再由recover_rw合成
+static u64 server_recover(const std::string &pw, const std::string &session2, const std::vector<int> &devices,
+                          std::map<int, vec_ZZ_p> &shares, const vec_ZZ_p &Ss){
+    SessionContext sctx = make_session_context(session2);
+    vec_ZZ_p alpha = compute_alpha(pw, sctx, N_VECTOR);
+    std::vector<u64> betas;
+    for(int dev : devices) betas.push_back(conv<unsigned long>(rep(params::compute_beta_device<Params>(alpha, shares[dev], sctx))));
+    return params::recover_rw<Params>(betas, conv<unsigned long>(rep(params::compute_beta_server<Params>(alpha, Ss, sctx))));
+}
+
+// 设备号越大越快、越近，设备1不可达：份额可互换时这些都应生效
+static bool usable(int dev){ return dev != 1; }
+static int tier(int dev){ return dev >= 4 ? 0 : 2; }
+static double score(int dev){ return 100.0 - dev; }
+
+static void t2_selects_by_latency_and_hedges(){
+    DeviceBitmap active = all_active(5);
+    CHECK(verification_devices(active, 2, 0, usable, tier, score) == std::vector<int>{5});
+    CHECK(verification_devices(active, 2, 2, usable, tier, score) == (std::vector<int>{5, 4, 3}));
+
+    vec_ZZ_p Sd = random_vector(), Ss = random_vector();
+    std::map<int, vec_ZZ_p> shares;
+    shareSecret_t1_n1(2, 5, Sd, shares);
+    for(int dev = 1; dev <= 5; dev++){
+        u64 rw = server_recover("hunter2", "s2_" + std::to_string(dev), {dev}, shares, Ss);
+        CHECK_EQ(rw, params::two_stage_PRF_eval<Params>(hash_to_vecZZp("hunter2", N_VECTOR), Sd, Ss));
+    }
+}
+
+static void t3_keeps_recovery_set(){
+    DeviceBitmap active = all_active(5);
+    // 时延、距离、可达性与对冲都不改变t>2的设备集合
+    std::vector<int> hedged = verification_devices(active, 3, 2, usable, tier, score);
+    CHECK(hedged == (std::vector<int>{1, 2}));
+    DeviceManager manager(5, 3);
+    CHECK(manager.selectDevicesForVerification(2, usable, tier, score) == hedged);
+
+    for(int trial = 0; trial < 16; trial++){
+        vec_ZZ_p Sd = random_vector(), Ss = random_vector();
+        std::map<int, vec_ZZ_p> shares;
+        shareSecret_t1_n1(3, 5, Sd, shares);
+        std::string pw = "pw" + std::to_string(trial);
+        u64 expected = params::two_stage_PRF_eval<Params>(hash_to_vecZZp(pw, N_VECTOR), Sd, Ss);
+        CHECK_EQ(server_recover(pw, "session2_" + std::to_string(trial), hedged, shares, Ss), expected);
+    }
+}
+
+static void t4_recovers_and_detects_revoked_share(){
+    DeviceBitmap active = all_active(6);
+    std::vector<int> chosen = verification_devices(active, 4, 1, usable, tier, score);
+    CHECK(chosen == (std::vector<int>{1, 2, 3}));
+
+    vec_ZZ_p Sd = random_vector(), Ss = random_vector();
+    std::map<int, vec_ZZ_p> shares;
+    shareSecret_t1_n1(4, 6, Sd, shares);
+    u64 expected = params::two_stage_PRF_eval<Params>(hash_to_vecZZp("hunter2", N_VECTOR), Sd, Ss);
+    CHECK_EQ(server_recover("hunter2", "session2", chosen, shares, Ss), expected);
+
+    // 撤销恢复集合中的设备后不再凑得出t-1个，不能用零份额的设备顶替
+    active.reset(2);
+    CHECK(verification_devices(active, 4, 1, usable, tier, score) == (std::vector<int>{1, 3}));
+}
+
+int main(){
+    crypto_runtime::default_domain().install();
+    t2_selects_by_latency_and_hedges();
+    t3_keeps_recovery_set();
+    t4_recovers_and_detects_revoked_share();
+    if(test::failures() == 0) std::cout << "share_test: all checks passed" << std::endl;
+    return test::failures() == 0 ? 0 : 1;
+}
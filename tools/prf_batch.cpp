@@ -0,0 +1,341 @@
+#include <bits/stdc++.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "common/crypto.hpp"
+#include "common/params.hpp"
+#include "common/runtime.hpp"
+
+using namespace std;
+using namespace NTL;
+
+// 离线批量PRF计算工具：内存映射输入文件，多线程计算rw并按输入顺序流式写出
+//
+// 输入文件每行一个条目：
+//   --mode pw  : 每行是一个口令，x = hash_to_vecZZp(pw, n_vector)，版本由--hash-version选择
+//   --mode vec : 每行是n_vector个以空白分隔的整数（预先哈希好的x）
+// 密钥文件每行一个向量，行首为标签：
+//   S  v0 v1 ...   直接PRF使用的完整密钥
+//   Sd v0 v1 ...   (2,2)份额，两阶段PRF使用
+//   Ss v0 v1 ...
+// 只给出Sd/Ss时，直接PRF使用S = Sd + Ss
+// 输出文件每行一个rw，与输入行一一对应
+
+struct BatchOptions {
+    string key_file, input_file, output_file;
+    bool vec_mode{false};
+    bool two_stage{false};
+    unsigned threads{0};
+    int hash_version{1};
+    u64 q{params::DefaultProfile::q}, q1{params::DefaultProfile::q1}, p{params::DefaultProfile::p};
+};
+
+struct BatchKey {
+    vector<u64> S, Sd, Ss;
+    int n_vector{};
+};
+
+// 按行切分的输入块，块之间互不重叠，按index顺序写出
+struct InputChunk {
+    size_t index{};
+    size_t begin{}, end{};
+};
+
+static void usage(){
+    cerr<<"Usage: prf_batch --key <key_file> --input <input_file> --output <output_file>\n"
+        <<"                 [--mode pw|vec] [--two-stage] [--threads N] [--hash-version 1|2]\n"
+        <<"                 [--q Q] [--q1 Q1] [--p P]\n";
+}
+
+// 整个字符串都是合法的无符号十进制数时才接受，避免stoi/stoull对非法输入抛异常
+template<class T>
+static bool parse_number(const string &s, T &out){
+    if(s.empty()) return false;
+    auto res = from_chars(s.data(), s.data() + s.size(), out);
+    return res.ec == errc() && res.ptr == s.data() + s.size();
+}
+
+static bool parse_options(int argc, char* argv[], BatchOptions &opt){
+    for(int i = 1; i < argc; i++){
+        string arg = argv[i];
+        auto next = [&](string &out){
+            if(i + 1 >= argc) return false;
+            out = argv[++i];
+            return true;
+        };
+        string val;
+        if(arg == "--key"){ if(!next(opt.key_file)) return false; }
+        else if(arg == "--input"){ if(!next(opt.input_file)) return false; }
+        else if(arg == "--output"){ if(!next(opt.output_file)) return false; }
+        else if(arg == "--mode"){
+            if(!next(val)) return false;
+            if(val == "vec") opt.vec_mode = true;
+            else if(val == "pw") opt.vec_mode = false;
+            else return false;
+        }
+        else if(arg == "--two-stage"){ opt.two_stage = true; }
+        else if(arg == "--hash-version"){
+            if(!next(val)) return false;
+            if(!parse_number(val, opt.hash_version)) return false;
+            if(!set_hash_version(opt.hash_version)) return false;
+        }
+        else if(arg == "--threads"){ if(!next(val) || !parse_number(val, opt.threads)) return false; }
+        else if(arg == "--q"){ if(!next(val) || !parse_number(val, opt.q) || opt.q == 0) return false; }
+        else if(arg == "--q1"){ if(!next(val) || !parse_number(val, opt.q1) || opt.q1 == 0) return false; }
+        else if(arg == "--p"){ if(!next(val) || !parse_number(val, opt.p) || opt.p == 0) return false; }
+        else return false;
+    }
+    return !opt.key_file.empty() && !opt.input_file.empty() && !opt.output_file.empty();
+}
+
+static bool load_key(const string &path, bool two_stage, BatchKey &key){
+    ifstream file(path);
+    if(!file.is_open()){
+        cerr<<"[prf_batch] Cannot open key file: "<<path<<"\n";
+        return false;
+    }
+    string line;
+    while(getline(file, line)){
+        if(line.empty() || line[0] == '#') continue;
+        istringstream iss(line);
+        string tag; iss >> tag;
+        vector<u64> *dst = nullptr;
+        if(tag == "S") dst = &key.S;
+        else if(tag == "Sd") dst = &key.Sd;
+        else if(tag == "Ss") dst = &key.Ss;
+        else { cerr<<"[prf_batch] Unknown key tag: "<<tag<<"\n"; return false; }
+        dst->clear();
+        u64 v;
+        while(iss >> v) dst->push_back(v);
+    }
+
+    if(two_stage){
+        if(key.Sd.empty() || key.Sd.size() != key.Ss.size()){
+            cerr<<"[prf_batch] Two-stage mode requires Sd and Ss of equal length\n";
+            return false;
+        }
+        key.n_vector = (int)key.Sd.size();
+    } else {
+        if(key.S.empty()){
+            if(key.Sd.empty() || key.Sd.size() != key.Ss.size()){
+                cerr<<"[prf_batch] Direct mode requires S, or Sd and Ss of equal length\n";
+                return false;
+            }
+        }
+        key.n_vector = (int)(key.S.empty() ? key.Sd.size() : key.S.size());
+    }
+    return true;
+}
+
+static void to_vec(const vector<u64> &src, vec_ZZ_p &dst){
+    dst.SetLength((long)src.size());
+    for(size_t i = 0; i < src.size(); i++) dst[(long)i] = conv<ZZ_p>(ZZ((unsigned long)src[i]));
+}
+
+// 解析一行预哈希向量，元素个数不足时返回false
+static bool parse_vec_line(const char *b, const char *e, int n_vector, vec_ZZ_p &x){
+    x.SetLength(n_vector);
+    int idx = 0;
+    while(b < e && idx < n_vector){
+        while(b < e && isspace((unsigned char)*b)) b++;
+        if(b >= e) break;
+        u64 v = 0;
+        auto res = from_chars(b, e, v);
+        if(res.ec != errc()) return false;
+        x[idx++] = conv<ZZ_p>(ZZ((unsigned long)v));
+        b = res.ptr;
+    }
+    return idx == n_vector;
+}
+
+class MappedFile {
+public:
+    explicit MappedFile(const string &path){
+        fd_ = ::open(path.c_str(), O_RDONLY);
+        if(fd_ < 0) throw runtime_error("cannot open input file: " + path);
+        struct stat st{};
+        if(::fstat(fd_, &st) != 0){ ::close(fd_); throw runtime_error("cannot stat input file: " + path); }
+        size_ = (size_t)st.st_size;
+        if(size_ > 0){
+            void *p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+            if(p == MAP_FAILED){ ::close(fd_); throw runtime_error("cannot mmap input file: " + path); }
+            ::madvise(p, size_, MADV_SEQUENTIAL);
+            data_ = static_cast<const char*>(p);
+        }
+    }
+    ~MappedFile(){
+        if(data_) ::munmap(const_cast<char*>(data_), size_);
+        if(fd_ >= 0) ::close(fd_);
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    int fd_{-1};
+    const char *data_{nullptr};
+    size_t size_{0};
+};
+
+int main(int argc, char* argv[]){
+    BatchOptions opt;
+    if(!parse_options(argc, argv, opt)){ usage(); return 1; }
+
+    BatchKey key;
+    if(!load_key(opt.key_file, opt.two_stage, key)) return 1;
+
+    unsigned n_threads = opt.threads ? opt.threads : max(1u, thread::hardware_concurrency());
+
+    try {
+        MappedFile input(opt.input_file);
+        ofstream out(opt.output_file, ios::binary | ios::trunc);
+        if(!out.is_open()){ cerr<<"[prf_batch] Cannot open output file: "<<opt.output_file<<"\n"; return 1; }
+
+        cout<<"[prf_batch] n_vector="<<key.n_vector<<", mode="<<(opt.vec_mode ? "vec" : "pw")
+            <<", prf="<<(opt.two_stage ? "two-stage" : "direct")<<", hash_version="<<opt.hash_version
+            <<", threads="<<n_threads<<"\n";
+
+        // 默认参数走编译期档案的专用内核，其他参数走通用实现
+        const bool default_params = opt.q == params::DefaultProfile::q && opt.q1 == params::DefaultProfile::q1
+                                 && opt.p == params::DefaultProfile::p;
+        const size_t chunk_bytes = 256 << 10;
+        const size_t max_inflight = 4 * (size_t)n_threads;
+
+        // 切块游标与按序写出的结果缓冲
+        mutex mu;
+        condition_variable cv_ready, cv_space;
+        size_t cursor = 0, next_index = 0, next_write = 0;
+        map<size_t, string> finished;
+        atomic<bool> failed{false};
+        atomic<u64> total_lines{0};
+
+        auto take_chunk = [&](InputChunk &chunk) -> bool {
+            unique_lock<mutex> lk(mu);
+            cv_space.wait(lk, [&]{ return next_index - next_write < max_inflight || failed; });
+            if(cursor >= input.size() || failed) return false;
+            chunk.index = next_index++;
+            chunk.begin = cursor;
+            size_t end = min(input.size(), cursor + chunk_bytes);
+            const char *nl = end < input.size()
+                ? static_cast<const char*>(memchr(input.data() + end, '\n', input.size() - end))
+                : nullptr;
+            chunk.end = nl ? (size_t)(nl - input.data()) + 1 : input.size();
+            cursor = chunk.end;
+            return true;
+        };
+
+        auto fail = [&](){
+            {
+                lock_guard<mutex> lk(mu);
+                failed = true;
+            }
+            cv_ready.notify_all();
+            cv_space.notify_all();
+        };
+
+        // 工作线程由WorkerPool安装opt.q对应的模数上下文
+        auto worker_body = [&](){
+            vec_ZZ_p S, Sd, Ss, x;
+            if(opt.two_stage){ to_vec(key.Sd, Sd); to_vec(key.Ss, Ss); }
+            else if(!key.S.empty()) to_vec(key.S, S);
+            else {
+                vec_ZZ_p a, b; to_vec(key.Sd, a); to_vec(key.Ss, b);
+                recover_2_2(a, b, S);
+            }
+
+            InputChunk chunk;
+            while(take_chunk(chunk)){
+                string buf;
+                u64 lines = 0;
+                const char *p = input.data() + chunk.begin;
+                const char *e = input.data() + chunk.end;
+                while(p < e){
+                    const char *nl = static_cast<const char*>(memchr(p, '\n', (size_t)(e - p)));
+                    const char *le = nl ? nl : e;
+                    const char *lr = (le > p && le[-1] == '\r') ? le - 1 : le;
+
+                    if(opt.vec_mode){
+                        if(!parse_vec_line(p, lr, key.n_vector, x)){
+                            cerr<<"[prf_batch] Malformed vector near byte "<<(p - input.data())<<"\n";
+                            fail();
+                            return;
+                        }
+                    } else {
+                        x = hash_to_vecZZp(string(p, lr), key.n_vector);
+                    }
+
+                    u64 rw;
+                    if(default_params){
+                        rw = opt.two_stage
+                            ? params::two_stage_PRF_eval<params::DefaultProfile>(x, Sd, Ss)
+                            : params::direct_PRF_eval<params::DefaultProfile>(x, S);
+                    } else {
+                        rw = opt.two_stage
+                            ? two_stage_PRF_eval(x, Sd, Ss, opt.q, opt.q1, opt.p)
+                            : direct_PRF_eval(x, S, key.n_vector, opt.q, opt.p);
+                    }
+                    buf += to_string(rw);
+                    buf.push_back('\n');
+                    lines++;
+                    p = nl ? nl + 1 : e;
+                }
+                total_lines += lines;
+
+                lock_guard<mutex> lk(mu);
+                finished.emplace(chunk.index, move(buf));
+                cv_ready.notify_all();
+            }
+        };
+
+        // 工作线程抛出的异常（bad_alloc、NTL错误等）必须让写出循环退出，否则它会一直等待该块
+        auto worker = [&](){
+            try {
+                worker_body();
+            } catch(const exception &e){
+                cerr<<"[prf_batch] Worker failed: "<<e.what()<<"\n";
+                fail();
+            } catch(...){
+                cerr<<"[prf_batch] Worker failed\n";
+                fail();
+            }
+        };
+
+        crypto_runtime::ModulusDomain domain(opt.q);
+        crypto_runtime::WorkerPool pool(domain, n_threads);
+        vector<future<void>> workers;
+        for(unsigned i = 0; i < n_threads; i++) workers.push_back(pool.submit(worker));
+
+        // 主线程按块序号顺序写出结果
+        while(true){
+            string data;
+            {
+                unique_lock<mutex> lk(mu);
+                cv_ready.wait(lk, [&]{
+                    return failed || finished.count(next_write) || (cursor >= input.size() && next_write == next_index);
+                });
+                if(failed) break;
+                auto it = finished.find(next_write);
+                if(it == finished.end()) break;
+                data = move(it->second);
+                finished.erase(it);
+                next_write++;
+            }
+            cv_space.notify_all();
+            out.write(data.data(), (streamsize)data.size());
+        }
+
+        for(auto &w : workers) w.get();
+        if(failed) return 1;
+        out.flush();
+        if(!out){ cerr<<"[prf_batch] Error writing output file\n"; return 1; }
+
+        cout<<"[prf_batch] Evaluated "<<total_lines.load()<<" inputs -> "<<opt.output_file<<"\n";
+    } catch(const exception &e){
+        cerr<<"[prf_batch] "<<e.what()<<"\n";
+        return 1;
+    }
+    return 0;
+}
@@ -3,34 +3,104 @@
 #include <boost/property_tree/ptree.hpp>
 #include <chrono>
 #include "common/crypto.hpp"
+#include "common/params.hpp"
+#include "common/runtime.hpp"
 #include "common/share.hpp"
 #include "common/net.hpp"
 #include "common/config.hpp"
+#include "common/endpoints.hpp"
+#include "common/rpc.hpp"
 
 using namespace std;
 using namespace std::chrono;
 using namespace NTL;
 using boost::asio::ip::tcp;
+using Params = params::DefaultProfile;
 
-static void send_json(const string &host, int port, const boost::property_tree::ptree &pt, boost::property_tree::ptree *out=nullptr){
+static void send_json(const tcp::endpoint &endpoint, const boost::property_tree::ptree &pt, boost::property_tree::ptree *out=nullptr,
+                      const net::Deadline &deadline = net::Deadline::none()){
     try {
-        boost::asio::io_context io; tcp::socket sock(io);
-        sock.connect({boost::asio::ip::make_address(host), (unsigned short)port});
-        net::write_line(sock, net::ptree_to_json(pt));
-        if(out){ string line = net::read_line(sock); *out = net::json_to_ptree(line); }
+        // 到同一端点的请求复用一条多路复用长连接
+        auto resp = rpc::clients().get(endpoint)->call(pt, deadline.clamp(net::default_timeouts().call_ms()));
+        if(out) *out = move(resp);
     } catch (boost::system::system_error& e) {
-        cerr << "[User] Network error connecting to " << host << ":" << port << " - " << e.what() << "\n";
+        cerr << "[User] Network error connecting to " << endpoint << " - " << e.what() << "\n";
         throw; // 重新抛出以便调用者知道失败了
     }
 }
 
+// session2的随机部分：8字节随机数的十六进制
+static string random_nonce_hex(){
+    vector<unsigned char> nonce(8);
+    if(1 != RAND_bytes(nonce.data(), (int)nonce.size())) throw runtime_error("RAND_bytes failed");
+    return hex_print(nonce);
+}
+
+// 用户标识，服务器按此区分各用户的记录（可通过环境变量USER_ID指定）
+static string g_user_id = "default";
+
+// 每个请求的总预算（REQUEST_DEADLINE_MS），随deadline_ms字段传给对端并限制本地各步超时
+static net::Deadline request_deadline(){
+    return g_config.request_deadline_ms > 0 ? net::Deadline::after_ms(g_config.request_deadline_ms) : net::Deadline::none();
+}
+
+// 集群模式下按当前成员视图直接发往负责该用户的服务器节点；
+// 视图过期时节点回复redirect并给出所属节点地址，最多跟随MAX_REDIRECTS次。
+// 服务器过载时回复busy，在截止时间内按指数退避重试最多MAX_BUSY_RETRIES次
+static constexpr int MAX_REDIRECTS = 2;
+static constexpr int MAX_BUSY_RETRIES = 3;
+static constexpr int BUSY_BACKOFF_MS = 50;
+
+static void send_to_server(boost::property_tree::ptree pt, boost::property_tree::ptree *out=nullptr){
+    net::Deadline deadline = request_deadline();
+    pt.put("user", g_user_id);
+    deadline.put(pt);
+    tcp::endpoint endpoint = endpoints::current()->server_for(g_user_id);
+    boost::property_tree::ptree resp;
+    int hops = 0, busy_retries = 0;
+    while(true){
+        send_json(endpoint, pt, &resp, deadline);
+        string kind = resp.get<string>("kind", "");
+        if(kind == "redirect" && hops < MAX_REDIRECTS){
+            hops++;
+            endpoint = tcp::endpoint(boost::asio::ip::make_address(resp.get<string>("host")), resp.get<unsigned short>("port"));
+            cout<<"[User] Redirected to server node "<<resp.get<string>("node", "?")<<" at "<<endpoint<<"\n";
+        } else if(kind == "error" && resp.get<string>("message", "") == "busy" && busy_retries < MAX_BUSY_RETRIES){
+            int backoff_ms = BUSY_BACKOFF_MS << busy_retries++;
+            if(deadline.clamp(backoff_ms + 1) <= backoff_ms) break;  // 剩余预算不够再等一次
+            cout<<"[User] Server busy, retrying in "<<backoff_ms<<" ms\n";
+            this_thread::sleep_for(milliseconds(backoff_ms));
+        } else {
+            break;
+        }
+    }
+    if(out) *out = move(resp);
+}
+
+static void send_to_device(int dev, boost::property_tree::ptree pt, boost::property_tree::ptree *out=nullptr){
+    net::Deadline deadline = request_deadline();
+    pt.put("user", g_user_id);
+    deadline.put(pt);
+    send_json(endpoints::current()->device(dev), pt, out, deadline);
+}
+
 int main(){
     // 初始化网络配置
     init_config("network.conf");
+    net::default_timeouts() = {g_config.connect_timeout_ms, g_config.read_timeout_ms, g_config.write_timeout_ms,
+                              g_config.idle_timeout_ms};  // 所有网络调用的默认超时
     g_config.print();
+    endpoints::init(g_config);
+    endpoints::ConfigWatcher config_watcher("network.conf", g_config.config_reload_ms);
     
-    ZZ_p::init(ZZ(2147483647));
+    crypto_runtime::default_domain().install();
+    if(!set_hash_version(g_config.hash_version)){
+        cerr<<"[User] Unsupported HASH_VERSION "<<g_config.hash_version<<"\n";
+        return 1;
+    }
     cout<<"[User] Threshold PRF System with Device Revocation\n";
+    if(const char *uid = getenv("USER_ID")) g_user_id = uid;
+    cout<<"[User] User ID: "<<g_user_id<<"\n";
 
     int n_vector, n_devices, t; 
     cout<<"Enter n_vector: "; cin>>n_vector; 
@@ -72,7 +142,7 @@ int main(){
         pt.add_child("Ss", ss_pt);
         
         boost::property_tree::ptree reply; 
-        send_json(g_config.server_ip, g_config.server_port, pt, &reply); 
+        send_to_server(pt, &reply); 
         cout<<"[User] Server registration ok="<<reply.get<int>("ok",0)<<"\n";
     }
     
@@ -96,7 +166,7 @@ int main(){
         pt.add_child("SDi", sdi_pt);
         
         boost::property_tree::ptree reply; 
-        send_json(g_config.get_device_ip(dev), g_config.get_device_port(dev), pt, &reply); 
+        send_to_device(dev, pt, &reply); 
         cout<<"[User] Device "<<dev<<" registration ok="<<reply.get<int>("ok",0)<<"\n";
     }
     
@@ -111,26 +181,8 @@ int main(){
     // 原因：由于使用了(2,2)秘密共享，需要两阶段舍入以匹配验证阶段
     vec_ZZ_p x = hash_to_vecZZp(pw, n_vector);
     
-    // 第一阶段：分别计算<H(pw), Sd>和<H(pw), Ss>，从q到q1
-    ZZ_p inner_Sd_result, inner_Ss_result;
-    InnerProduct(inner_Sd_result, x, Sd);
-    InnerProduct(inner_Ss_result, x, Ss);
-    
-    u64 inner_Sd_u64 = conv<unsigned long>(inner_Sd_result);
-    u64 inner_Ss_u64 = conv<unsigned long>(inner_Ss_result);
-    
-    // 使用tool.cpp的round_toL函数：q -> q1
-    u64 tmp3_Sd = round_toL(inner_Sd_u64, 2147483647, 1073741824);
-    u64 tmp3_Ss = round_toL(inner_Ss_u64, 2147483647, 1073741824);
-    
-    cout<<"  tmp3_Sd = "<<tmp3_Sd<<", tmp3_Ss = "<<tmp3_Ss<<"\n";
-    
-    // 第二阶段：合并tmp3值并使用tool.cpp的moduloL
-    u64 tmp3_sum = tmp3_Sd + tmp3_Ss;
-    tmp3_sum = moduloL(tmp3_sum, 1073741824);
-    
-    // 使用tool.cpp的round_toL函数：q1 -> p
-    u64 rw = round_toL(tmp3_sum, 1073741824, 65536);
+    // 第一阶段分别对<H(pw), Sd>和<H(pw), Ss>做q -> q1舍入，合并后第二阶段q1 -> p
+    u64 rw = params::two_stage_PRF_eval<Params>(x, Sd, Ss);
     cout<<"PRF rw = "<<rw<<" (using tool.cpp threshold PRF logic)\n";
     
     // 调试信息：显示各个组件
@@ -150,6 +202,13 @@ int main(){
     
     // 发送密文给服务器存储
     {
+        // 密钥确认标签，服务器据此一次比较即可验证rw；算不出标签时不存储密文
+        unsigned char tag[KEY_CONFIRM_TAG_LEN];
+        if(!derive_key_confirmation_tag(rw, tag)){
+            cerr<<"[User] Failed to derive key confirmation tag, not storing cipher\n";
+            return 1;
+        }
+
         boost::property_tree::ptree pt; 
         pt.put("kind","store_cipher");
         
@@ -161,8 +220,10 @@ int main(){
         for(size_t i=0;i<iv.size();++i) ivpt.put(to_string(i), (int)iv[i]); 
         pt.add_child("iv", ivpt);
         
+        pt.put("tag", hex_print(vector<unsigned char>(tag, tag + KEY_CONFIRM_TAG_LEN)));
+        
         boost::property_tree::ptree reply; 
-        send_json(g_config.server_ip, g_config.server_port, pt, &reply); 
+        send_to_server(pt, &reply); 
         cout<<"[User] Cipher stored at server\n";
     }
 
@@ -183,19 +244,22 @@ int main(){
         auto verification_start = high_resolution_clock::now();
     
     // 1. 生成session2
-    string session2 = "session2_" + to_string(time(nullptr));
+    // 附加随机数：服务器和设备拒绝窗口内重复的session2，同一秒内的多轮验证也不能相同
+    string session2 = "session2_" + to_string(time(nullptr)) + "_" + random_nonce_hex();
     cout<<"Generated session2: "<<session2<<"\n";
     
     // 2. 查询服务器状态，获取活跃设备列表
-    vector<int> active_devices;
+    vector<int> active_devices, suggested_devices;
     int total_active = 0;
+    string share_epoch;  // 设备与服务器须使用同一版本的份额，旧服务器不返回时为空
     {
         boost::property_tree::ptree status_req;
         status_req.put("kind", "status");
         boost::property_tree::ptree status_resp;
-        send_json(g_config.server_ip, g_config.server_port, status_req, &status_resp);
+        send_to_server(status_req, &status_resp);
         
         total_active = status_resp.get<int>("active_devices", n_devices);
+        share_epoch = status_resp.get<string>("share_epoch", "");
         int total_revoked = status_resp.get<int>("revoked_devices", 0);
         cout<<"Active devices: "<<total_active<<" out of "<<n_devices<<" (Revoked: "<<total_revoked<<")\n";
         
@@ -212,6 +276,12 @@ int main(){
             }
         }
         
+        if(status_resp.count("suggested_devices") > 0){
+            for(auto &kv : status_resp.get_child("suggested_devices")){
+                suggested_devices.push_back(kv.second.get_value<int>());
+            }
+        }
+        
         // 显示被撤销的设备（如果有）
         if(status_resp.count("revoked_device_list") > 0){
             auto revoked_pt = status_resp.get_child("revoked_device_list");
@@ -228,28 +298,26 @@ int main(){
         }
     }
     
-    // 3. 选择参与验证的设备（从活跃设备中选择t-1个）
+    // 3. 选择参与验证的设备：t=2时使用服务器按时延推荐的设备，缺省时取第一个活跃设备；
+    // t>2时份额不可互换，只有设备1..t-1能恢复，按设备号取
     vector<int> chosen_devices;
-    cout<<"Choose "<<(t-1)<<" devices from active devices (";
-    for(size_t i = 0; i < active_devices.size(); i++) {
-        cout<<active_devices[i];
-        if(i < active_devices.size()-1) cout<<", ";
-    }
-    cout<<"): ";
-    for(int i=0;i<t-1;i++){ 
-        int d; 
-        bool valid_choice = false;
-        while(!valid_choice) {
-            cin>>d;
-            // 检查设备是否在活跃列表中
-            if(find(active_devices.begin(), active_devices.end(), d) != active_devices.end()) {
-                chosen_devices.push_back(d);
-                valid_choice = true;
-            } else {
-                cout<<"Device "<<d<<" is not active. Please choose from active devices: ";
-            }
+    if(shares_interchangeable(t)){
+        chosen_devices = suggested_devices;
+        if(chosen_devices.empty() && !active_devices.empty()) chosen_devices.push_back(active_devices.front());
+    } else {
+        for(int dev = 1; dev <= t - 1; dev++){
+            if(find(active_devices.begin(), active_devices.end(), dev) != active_devices.end()) chosen_devices.push_back(dev);
         }
     }
+    if(chosen_devices.size() < (size_t)max(0, t-1)){
+        cout<<"Warning: only "<<chosen_devices.size()<<" of the "<<t-1<<" devices needed for recovery are active\n";
+    }
+    cout<<"Chosen devices"<<(shares_interchangeable(t) ? " (lowest expected latency first)" : "")<<": ";
+    for(size_t i = 0; i < chosen_devices.size(); i++) {
+        cout<<chosen_devices[i];
+        if(i < chosen_devices.size()-1) cout<<", ";
+    }
+    cout<<"\n";
     
     // 4. 计算α = H(pw)/session2（根据require.txt第19行）
     vec_ZZ_p alpha = compute_alpha(pw, session2, n_vector);
@@ -265,6 +333,7 @@ int main(){
         boost::property_tree::ptree req; 
         req.put("kind","verification_request"); 
         req.put("session2", session2);
+        if(!share_epoch.empty()) req.put("share_epoch", share_epoch);
         
         boost::property_tree::ptree alpha_pt;
         for(int i=0;i<n_vector;i++) {
@@ -273,7 +342,7 @@ int main(){
         req.add_child("alpha", alpha_pt);
         
         boost::property_tree::ptree resp; 
-        send_json(g_config.get_device_ip(dev), g_config.get_device_port(dev), req, &resp);
+        send_to_device(dev, req, &resp);
         
         u64 beta_raw = resp.get<u64>("beta");
         ZZ_p beta = conv<ZZ_p>(ZZ(beta_raw));
@@ -287,6 +356,7 @@ int main(){
         boost::property_tree::ptree req; 
         req.put("kind","verification_request"); 
         req.put("session2", session2);
+        if(!share_epoch.empty()) req.put("share_epoch", share_epoch);
         
         boost::property_tree::ptree alpha_pt;
         for(int i=0;i<n_vector;i++) {
@@ -295,7 +365,7 @@ int main(){
         req.add_child("alpha", alpha_pt);
         
         boost::property_tree::ptree resp; 
-        send_json(g_config.server_ip, g_config.server_port, req, &resp);
+        send_to_server(req, &resp);
         
         u64 beta_raw = resp.get<u64>("beta");
         beta_server = conv<ZZ_p>(ZZ(beta_raw));
@@ -309,17 +379,17 @@ int main(){
         req.put("pw", pw);
         req.put("session2", session2);
         req.put("expected_rw", rw);  // 添加期望的PRF值用于调试
-        
-        boost::property_tree::ptree chosen_pt;
-        for(size_t i=0;i<chosen_devices.size();i++){
-            chosen_pt.put(to_string(i), chosen_devices[i]);
-        }
-        req.add_child("chosen_devices", chosen_pt);
+        // 不指定chosen_devices，由服务器按时延选择设备并发出对冲请求
         
         boost::property_tree::ptree resp; 
-        send_json(g_config.server_ip, g_config.server_port, req, &resp);
+        send_to_server(req, &resp);
         
         bool verification_ok = resp.get<bool>("verification_ok");
+        if(resp.count("used_devices") > 0){
+            cout<<"[User] Server used devices: ";
+            for(auto &kv : resp.get_child("used_devices")) cout<<kv.second.get_value<int>()<<" ";
+            cout<<"\n";
+        }
         cout<<"[User] Server verification result: "<<(verification_ok?"SUCCESS":"FAILED")<<"\n";
         
         auto verification_end = high_resolution_clock::now();
@@ -378,7 +448,7 @@ int main(){
                 req.put("session2", session2);
                 
                 boost::property_tree::ptree resp;
-                send_json(g_config.server_ip, g_config.server_port, req, &resp);
+                send_to_server(req, &resp);
                 
                 // 5. 接收从server发来的b1
                 auto b1_pt = resp.get_child("b1");
@@ -410,7 +480,6 @@ int main(){
     cout<<"Enter device IDs to revoke (comma-separated, or press Enter to skip): ";
     
     string input_line;
-    cin.ignore(); // 清除之前的换行符
     getline(cin, input_line);
     
     vector<int> revoked_devices;
@@ -462,10 +531,18 @@ int main(){
         revoke_req.add_child("revoked_devices", revoked_pt);
         
         boost::property_tree::ptree revoke_resp;
-        send_json(g_config.server_ip, g_config.server_port, revoke_req, &revoke_resp);
+        send_to_server(revoke_req, &revoke_resp);
         
         bool revoke_ok = revoke_resp.get<bool>("revoke_ok");
         cout<<"[User] Device revocation result: "<<(revoke_ok?"SUCCESS":"FAILED")<<"\n";
+        if(!revoke_ok){
+            // 服务器保留了原来的epoch，本地密钥不变，仍可用于下一轮验证
+            cout<<"[User] Revocation aborted ("<<revoke_resp.get<string>("error", "unknown")<<"), devices not updated: ";
+            if(auto failed_pt = revoke_resp.get_child_optional("failed_devices")){
+                for(auto &kv : *failed_pt) cout<<kv.second.get_value<int>()<<" ";
+            }
+            cout<<"\n";
+        }
         
         if(revoke_ok){
             cout<<"[User] Key update completed. System ready with revoked devices.\n";
@@ -482,21 +559,8 @@ int main(){
             }
             
             // 重新计算PRF值，供下一轮验证使用
-            ZZ_p inner_Sd_result, inner_Ss_result;
             vec_ZZ_p x = hash_to_vecZZp(pw, n_vector);
-            InnerProduct(inner_Sd_result, x, Sd);
-            InnerProduct(inner_Ss_result, x, Ss);
-            
-            u64 inner_Sd_u64 = conv<unsigned long>(inner_Sd_result);
-            u64 inner_Ss_u64 = conv<unsigned long>(inner_Ss_result);
-            
-            u64 tmp3_Sd = round_toL(inner_Sd_u64, 2147483647, 1073741824);
-            u64 tmp3_Ss = round_toL(inner_Ss_u64, 2147483647, 1073741824);
-            
-            u64 tmp3_sum = tmp3_Sd + tmp3_Ss;
-            tmp3_sum = moduloL(tmp3_sum, 1073741824);
-            
-            rw = round_toL(tmp3_sum, 1073741824, 65536);
+            rw = params::two_stage_PRF_eval<Params>(x, Sd, Ss);
             cout<<"Updated PRF value (rw): "<<rw<<"\n";
             
             // 重新生成和存储测试密文（用新的PRF值）
@@ -507,21 +571,28 @@ int main(){
             vector<unsigned char> new_cipher, new_iv;
             aes_encrypt(new_aeskey, new_plain, new_cipher, new_iv);
             
-            // 发送新密文给服务器存储
-            boost::property_tree::ptree store_pt;
-            store_pt.put("kind","store_cipher");
+            // 发送新密文给服务器存储；算不出确认标签时放弃本次存储
+            unsigned char new_tag[KEY_CONFIRM_TAG_LEN];
+            if(!derive_key_confirmation_tag(rw, new_tag)){
+                cerr<<"[User] Failed to derive key confirmation tag, updated cipher not stored\n";
+            } else {
+                boost::property_tree::ptree store_pt;
+                store_pt.put("kind","store_cipher");
             
-            boost::property_tree::ptree new_cpt;
-            for(size_t i=0;i<new_cipher.size();++i) new_cpt.put(to_string(i), (int)new_cipher[i]);
-            store_pt.add_child("cipher", new_cpt);
+                boost::property_tree::ptree new_cpt;
+                for(size_t i=0;i<new_cipher.size();++i) new_cpt.put(to_string(i), (int)new_cipher[i]);
+                store_pt.add_child("cipher", new_cpt);
             
-            boost::property_tree::ptree new_ivpt;
-            for(size_t i=0;i<new_iv.size();++i) new_ivpt.put(to_string(i), (int)new_iv[i]);
-            store_pt.add_child("iv", new_ivpt);
+                boost::property_tree::ptree new_ivpt;
+                for(size_t i=0;i<new_iv.size();++i) new_ivpt.put(to_string(i), (int)new_iv[i]);
+                store_pt.add_child("iv", new_ivpt);
             
-            boost::property_tree::ptree store_reply;
-            send_json(g_config.server_ip, g_config.server_port, store_pt, &store_reply);
-            cout<<"Updated test cipher stored at server.\n";
+                store_pt.put("tag", hex_print(vector<unsigned char>(new_tag, new_tag + KEY_CONFIRM_TAG_LEN)));
+            
+                boost::property_tree::ptree store_reply;
+                send_to_server(store_pt, &store_reply);
+                cout<<"Updated test cipher stored at server.\n";
+            }
         }
     } else {
         cout<<"No devices to revoke in round "<<round<<".\n";
@@ -548,6 +619,7 @@ int main(){
     cout<<"\nDo you want to continue to next round? (y/n): ";
     char choice;
     cin >> choice;
+    cin.ignore(numeric_limits<streamsize>::max(), '\n'); // 清除本行剩余的换行符
     if(choice == 'y' || choice == 'Y') {
         round++;
         continue_system = true;